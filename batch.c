@@ -0,0 +1,164 @@
+/*
+ *  sku - analysis tool for Sudoku puzzles
+ *  Copyright (C) 2005  Richard P. Curnow
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include <sys/time.h>
+
+#include "sku.h"
+
+static double timestamp(void)/*{{{*/
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double) tv.tv_sec + 1.0e-6 * (double) tv.tv_usec;
+}
+/*}}}*/
+
+/* ============================================================================ */
+
+struct grid_job {/*{{{*/
+  GRID_OP op;
+  const struct op_args *args;
+  struct layout *lay;
+  int *state;
+  long seed;
+  char *output;         /* everything the operation wrote for this grid */
+  size_t output_len;
+  struct context ctx;   /* kept for the next grid in this slot, so that
+                           infer()'s buffers and plans get reused */
+};
+/*}}}*/
+static void run_grid_job(void *arg)/*{{{*/
+{
+  struct grid_job *job = (struct grid_job *) arg;
+  struct context *ctx = &job->ctx;
+
+  seed_context(ctx, job->seed);
+  ctx->out = open_memstream(&job->output, &job->output_len);
+  if (!ctx->out) {
+    perror("open_memstream");
+    exit(1);
+  }
+  (job->op)(ctx, job->lay, job->state, job->args);
+  fclose(ctx->out);
+  free(job->state);
+}
+/*}}}*/
+static int for_each_grid_threaded(GRID_OP op, const struct op_args *args)/*{{{*/
+{
+  /* Read the input in blocks, spread each block over the thread pool, then
+   * write the results out in the order the grids were read.  If the input
+   * goes bad part way, the grids before that still get done, as they would
+   * one at a time. */
+  struct pool *pool;
+  struct grid_job *jobs;
+  int block_size;
+  int n_grids;
+  int n, i;
+  int status;
+
+  pool = pool_create(args->n_threads);
+  block_size = 64 * args->n_threads;
+  jobs = new_array(struct grid_job, block_size);
+  for (i=0; i<block_size; i++) {
+    init_context(&jobs[i].ctx, 0);
+  }
+  n_grids = 0;
+  read_grid(&jobs[0].lay, &jobs[0].state, args->options);
+  n = 1;
+  status = 1;
+  while (1) {
+    struct task_group group;
+
+    while ((n < block_size) &&
+           ((status = read_next_grid(&jobs[n].lay, &jobs[n].state, args->options)) > 0)) {
+      n++;
+    }
+    if (n == 0) break;
+
+    group.pending = 0;
+    for (i=0; i<n; i++) {
+      jobs[i].op = op;
+      jobs[i].args = args;
+      jobs[i].seed = derive_seed(args->seed, n_grids + i);
+      jobs[i].output = NULL;
+      jobs[i].output_len = 0;
+      pool_submit(pool, &group, run_grid_job, jobs + i);
+    }
+    pool_wait(pool, &group);
+    for (i=0; i<n; i++) {
+      fwrite(jobs[i].output, 1, jobs[i].output_len, stdout);
+      free(jobs[i].output);
+    }
+    n_grids += n;
+    n = 0;
+    if (status < 0) report_read_error(status);
+  }
+
+  for (i=0; i<block_size; i++) {
+    free_context(&jobs[i].ctx);
+  }
+  free(jobs);
+  pool_destroy(pool);
+  return n_grids;
+}
+/*}}}*/
+void for_each_grid(GRID_OP op, const struct op_args *args)/*{{{*/
+{
+  /* Without -B, read one grid, apply the operation to it and return.  With
+   * -B, keep going until the input runs out, so that one process can work
+   * through a whole file of concatenated puzzles. */
+  struct context ctx;
+  struct layout *lay;
+  int *state;
+  int n_grids;
+  int status;
+  double t0, elapsed;
+
+  t0 = timestamp();
+  n_grids = 0;
+  if ((args->options & OPT_BATCH) && (args->n_threads > 1)) {
+    n_grids = for_each_grid_threaded(op, args);
+  } else {
+    /* A single grid at a time: use any threads for speculating within it. */
+    struct pool *pool = (args->n_threads > 1) ? pool_create(args->n_threads) : NULL;
+    init_context(&ctx, 0);
+    ctx.pool = pool;
+    read_grid(&lay, &state, args->options);
+    do {
+      seed_context(&ctx, derive_seed(args->seed, n_grids));
+      (op)(&ctx, lay, state, args);
+      free(state);
+      ++n_grids;
+      if (!(args->options & OPT_BATCH)) break;
+      status = read_next_grid(&lay, &state, args->options);
+      if (status < 0) report_read_error(status);
+    } while (status > 0);
+    free_context(&ctx);
+    if (pool) pool_destroy(pool);
+  }
+
+  if (args->options & OPT_BATCH) {
+    fflush(stdout);
+    elapsed = timestamp() - t0;
+    fprintf(stderr, "Processed %d grid%s in %.3f seconds (%.1f grids/sec)\n",
+        n_grids, (n_grids == 1) ? "" : "s", elapsed,
+        (elapsed > 0.0) ? ((double) n_grids / elapsed) : 0.0);
+  }
+}
+/*}}}*/
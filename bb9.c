@@ -0,0 +1,270 @@
+/*
+ *  sku - analysis tool for Sudoku puzzles
+ *  Copyright (C) 2005  Richard P. Curnow
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/* Brute force solver for the standard 9x9 layout, used by infer() when it is
+ * only being asked to count solutions (or find one) with speculation allowed.
+ * Rather than going through the generic group tables and work queues, the
+ * candidates are held as one 9x9 bitboard per symbol, a 9-bit mask of columns
+ * for each row.  Whole-board questions ("which cells have one option left?",
+ * "where can this symbol go in column 5?") are then a handful of logical
+ * operations over short arrays, which the compiler can vectorise.  Propagation
+ * is by naked and hidden singles only; anything else is left to backtracking
+ * on the cell with the fewest options. */
+
+#include "sku.h"
+#include <stdint.h>
+
+struct bb9 {/*{{{*/
+  uint16_t cand[9][9];  /* [symbol][row] columns where the symbol is still possible */
+  uint16_t open[9];     /* [row] columns not filled in yet */
+  uint16_t in_row[9];   /* [symbol] rows, columns and boxes it has been placed in */
+  uint16_t in_col[9];
+  uint16_t in_box[9];
+  signed char value[81];
+};
+/*}}}*/
+struct bb9_search {/*{{{*/
+  struct context *ctx;
+  int n_found;
+  int max_found;
+  int *state;
+};
+/*}}}*/
+
+#define ALL9 0x1ff
+#define ONE_BIT(x) (((x) & ((x) - 1)) == 0)
+
+static int place(struct bb9 *g, int r, int c, int s)/*{{{*/
+{
+  /* Returns 0 if 's' can no longer go at (r,c). */
+  uint16_t bit = 1 << c;
+  uint16_t box_cols = 7 << (3 * (c / 3));
+  int r0 = 3 * (r / 3);
+  int t;
+
+  if (!(g->cand[s][r] & bit)) return 0;
+  g->value[9*r + c] = s;
+  g->open[r] &= ~bit;
+  for (t=0; t<9; t++) {
+    g->cand[t][r] &= ~bit;
+    g->cand[s][t] &= ~bit;
+  }
+  g->cand[s][r] = 0;
+  g->cand[s][r0] &= ~box_cols;
+  g->cand[s][r0 + 1] &= ~box_cols;
+  g->cand[s][r0 + 2] &= ~box_cols;
+  g->in_row[s] |= 1 << r;
+  g->in_col[s] |= bit;
+  g->in_box[s] |= 1 << (r0 + (c / 3));
+  return 1;
+}
+/*}}}*/
+static int cell_options(const struct bb9 *g, int r, int c)/*{{{*/
+{
+  int s, result = 0;
+  for (s=0; s<9; s++) {
+    result |= ((g->cand[s][r] >> c) & 1) << s;
+  }
+  return result;
+}
+/*}}}*/
+static int naked_singles(struct bb9 *g, int *progress)/*{{{*/
+{
+  /* Cells where exactly one symbol is still possible. */
+  int r, s;
+  for (r=0; r<9; r++) {
+    uint16_t once = 0, twice = 0, singles;
+    for (s=0; s<9; s++) {
+      twice |= once & g->cand[s][r];
+      once |= g->cand[s][r];
+    }
+    if (g->open[r] & ~once) return 0;
+    singles = once & ~twice;
+    while (singles) {
+      int c = __builtin_ctz(singles);
+      int opts = cell_options(g, r, c);
+      singles &= singles - 1;
+      /* An earlier placement in this row may have taken the last option. */
+      if (!opts) return 0;
+      place(g, r, c, __builtin_ctz(opts));
+      *progress = 1;
+    }
+  }
+  return 1;
+}
+/*}}}*/
+static int hidden_singles(struct bb9 *g, int *progress)/*{{{*/
+{
+  /* Symbols with only one place left in a row, column or box.  Placements
+   * made part way through can leave later findings stale, so those are just
+   * skipped and picked up again on the next round. */
+  int s, r, c, b;
+  for (s=0; s<9; s++) {
+    uint16_t once, twice, singles;
+    uint16_t *cand = g->cand[s];
+
+    for (r=0; r<9; r++) {
+      if (g->in_row[s] & (1<<r)) continue;
+      if (!cand[r]) return 0;
+      if (ONE_BIT(cand[r])) {
+        if (place(g, r, __builtin_ctz(cand[r]), s)) *progress = 1;
+      }
+    }
+
+    once = twice = 0;
+    for (r=0; r<9; r++) {
+      twice |= once & cand[r];
+      once |= cand[r];
+    }
+    if (ALL9 & ~(once | g->in_col[s])) return 0;
+    singles = once & ~twice;
+    while (singles) {
+      c = __builtin_ctz(singles);
+      singles &= singles - 1;
+      for (r=0; r<9; r++) {
+        if (cand[r] & (1<<c)) {
+          if (place(g, r, c, s)) *progress = 1;
+          break;
+        }
+      }
+    }
+
+    for (b=0; b<9; b++) {
+      int r0 = 3 * (b / 3), shift = 3 * (b % 3);
+      uint16_t m;
+      if (g->in_box[s] & (1<<b)) continue;
+      m = ((cand[r0] >> shift) & 7) |
+          (((cand[r0 + 1] >> shift) & 7) << 3) |
+          (((cand[r0 + 2] >> shift) & 7) << 6);
+      if (!m) return 0;
+      if (ONE_BIT(m)) {
+        int k = __builtin_ctz(m);
+        if (place(g, r0 + k / 3, shift + k % 3, s)) *progress = 1;
+      }
+    }
+  }
+  return 1;
+}
+/*}}}*/
+static int propagate(struct bb9 *g)/*{{{*/
+{
+  /* Apply singles until nothing changes.  Returns 0 on a contradiction. */
+  int progress;
+  do {
+    progress = 0;
+    if (!naked_singles(g, &progress)) return 0;
+    if (progress) continue;
+    if (!hidden_singles(g, &progress)) return 0;
+  } while (progress);
+  return 1;
+}
+/*}}}*/
+static int choose_cell(const struct bb9 *g)/*{{{*/
+{
+  /* The open cell with the fewest options, preferring the first with only 2.
+   * Returns -1 if the grid is full. */
+  int r, s, best, best_n;
+
+  best = -1;
+  best_n = 10;
+  for (r=0; r<9; r++) {
+    uint16_t once = 0, twice = 0, thrice = 0, pairs, open;
+    if (!g->open[r]) continue;
+    for (s=0; s<9; s++) {
+      thrice |= twice & g->cand[s][r];
+      twice |= once & g->cand[s][r];
+      once |= g->cand[s][r];
+    }
+    pairs = twice & ~thrice;
+    if (pairs) return 9*r + __builtin_ctz(pairs);
+    for (open = g->open[r]; open; open &= open - 1) {
+      int c = __builtin_ctz(open);
+      int n = count_bits(cell_options(g, r, c));
+      if (n < best_n) {
+        best = 9*r + c;
+        best_n = n;
+      }
+    }
+  }
+  return best;
+}
+/*}}}*/
+static void search(struct bb9_search *bs, const struct bb9 *g)/*{{{*/
+{
+  int ci, opts, start_point, i;
+
+  ci = choose_cell(g);
+  if (ci < 0) {
+    if (bs->n_found == 0) {
+      for (i=0; i<81; i++) bs->state[i] = g->value[i];
+    }
+    bs->n_found++;
+    return;
+  }
+  if (bs->ctx->abandon && __atomic_load_n(bs->ctx->abandon, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  /* Random starting point, as in speculate(), so that -a gives a random
+   * completion. */
+  opts = cell_options(g, ci / 9, ci % 9);
+  start_point = ctx_random(bs->ctx) % 9;
+  for (i=0; i<9; i++) {
+    int s = (i + start_point) % 9;
+    struct bb9 next;
+    if (!(opts & (1<<s))) continue;
+    next = *g;
+    place(&next, ci / 9, ci % 9, s);
+    if (propagate(&next)) {
+      search(bs, &next);
+      if (bs->max_found && (bs->n_found >= bs->max_found)) return;
+    }
+  }
+}
+/*}}}*/
+int bb9_solve(struct context *ctx, int *state, int max_solutions)/*{{{*/
+{
+  /* Count the solutions of a standard 9x9 grid, stopping after max_solutions
+   * (0 for no limit).  If there is one, the first found is written to 'state';
+   * otherwise 'state' is left alone. */
+  struct bb9 g;
+  struct bb9_search bs;
+  int ci, r, s;
+
+  for (s=0; s<9; s++) {
+    for (r=0; r<9; r++) g.cand[s][r] = ALL9;
+    g.in_row[s] = g.in_col[s] = g.in_box[s] = 0;
+  }
+  for (r=0; r<9; r++) g.open[r] = ALL9;
+  for (ci=0; ci<81; ci++) g.value[ci] = -1;
+  for (ci=0; ci<81; ci++) {
+    if (state[ci] >= 0) {
+      if (!place(&g, ci / 9, ci % 9, state[ci])) return 0;
+    }
+  }
+  if (!propagate(&g)) return 0;
+
+  bs.ctx = ctx;
+  bs.n_found = 0;
+  bs.max_found = max_solutions;
+  bs.state = state;
+  search(&bs, &g);
+  return bs.n_found;
+}
+/*}}}*/
@@ -0,0 +1,132 @@
+/*
+ *  sku - analysis tool for Sudoku puzzles
+ *  Copyright (C) 2005  Richard P. Curnow
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/* Microbenchmark for finding the symbols with at most one home in a group, as
+ * try_group_allocate() does: the old loop, which counts the homes of each
+ * unplaced symbol in turn, against the once/twice masks of
+ * homes_at_most_one().  Build with 'make bench_singles'.
+ *
+ * The groups are random, with about a third of the candidates set in each
+ * cell, which is roughly what the rules see part way through a puzzle. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define N_GROUPS 4096
+#define N_PASSES 2000
+
+static unsigned int poss[N_GROUPS][32];
+static unsigned int todo[N_GROUPS];
+
+static void fill_groups(int ns)/*{{{*/
+{
+  int g, j, s;
+  for (g=0; g<N_GROUPS; g++) {
+    todo[g] = 0;
+    for (j=0; j<ns; j++) {
+      poss[g][j] = 0;
+      for (s=0; s<ns; s++) {
+        if ((rand() % 3) == 0) poss[g][j] |= 1U << s;
+      }
+      todo[g] |= poss[g][j];
+    }
+  }
+}
+/*}}}*/
+static unsigned int old_loop(const unsigned int *p, unsigned int todo, int ns)/*{{{*/
+{
+  unsigned int hits = 0;
+  int sym, j, count;
+  for (sym=0; sym<ns; sym++) {
+    unsigned int mask = 1U << sym;
+    if (todo & mask) {
+      count = 0;
+      for (j=0; j<ns; j++) {
+        if (p[j] & mask) {
+          count++;
+          if (count > 1) break;
+        }
+      }
+      if (count <= 1) hits |= mask;
+    }
+  }
+  return hits;
+}
+/*}}}*/
+static unsigned int once_twice(const unsigned int *p, unsigned int todo, int ns)/*{{{*/
+{
+  unsigned int once = 0, twice = 0;
+  int j;
+  for (j=0; j<ns; j++) {
+    twice |= once & p[j];
+    once |= p[j];
+  }
+  return todo & ~twice;
+}
+/*}}}*/
+typedef unsigned int (*finder)(const unsigned int *, unsigned int, int);
+
+static double time_it(finder f, int ns, unsigned int *check)/*{{{*/
+{
+  /* Called through a volatile pointer so that the compiler can't hoist the
+   * work out of the passes. */
+  finder volatile fn = f;
+  struct timespec t0, t1;
+  unsigned int sum = 0;
+  int pass, g;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (pass=0; pass<N_PASSES; pass++) {
+    for (g=0; g<N_GROUPS; g++) {
+      sum += fn(poss[g], todo[g], ns);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  *check = sum;
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+    ((double) N_PASSES * N_GROUPS);
+}
+/*}}}*/
+int main(void)/*{{{*/
+{
+  static const int sizes[] = {9, 16, 25};
+  int i, g;
+  srand(1);
+  for (i=0; i<3; i++) {
+    int ns = sizes[i];
+    unsigned int c0, c1;
+    double t0, t1;
+    fill_groups(ns);
+    for (g=0; g<N_GROUPS; g++) {
+      if (old_loop(poss[g], todo[g], ns) != once_twice(poss[g], todo[g], ns)) {
+        fprintf(stderr, "Results differ for NS=%d\n", ns);
+        exit(1);
+      }
+    }
+    t0 = time_it(old_loop, ns, &c0);
+    t1 = time_it(once_twice, ns, &c1);
+    if (c0 != c1) {
+      fprintf(stderr, "Checksums differ for NS=%d\n", ns);
+      exit(1);
+    }
+    printf("NS=%-3d old loop %6.1f ns/group, once/twice %6.1f ns/group\n", ns, t0, t1);
+  }
+  return 0;
+}
+/*}}}*/
@@ -19,7 +19,7 @@
 
 #include "sku.h"
 
-void display(FILE *out, struct layout *lay, int *state)/*{{{*/
+void display(FILE *out, const struct layout *lay, int *state)/*{{{*/
 {
   int mn, i, j;
   char *grid;
@@ -0,0 +1,255 @@
+/*
+ *  sku - analysis tool for Sudoku puzzles
+ *  Copyright (C) 2005  Richard P. Curnow
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/* Exact cover solver (Knuth's "dancing links"), for when all we need to know
+ * is whether a grid has 0, 1 or more solutions.  It knows nothing about the
+ * human-style rules in infer.c; the matrix is built straight from the layout's
+ * groups, so overlapping grids and extra groups (diagonals etc) come for free.
+ *
+ * There is one row per (cell, symbol) pair, and one column per cell plus one
+ * per (group, symbol) pair.  The rows and columns already settled by the
+ * givens are left out altogether. */
+
+#include "sku.h"
+
+struct dlx {/*{{{*/
+  int ns;
+  int n_cols;
+  /* Node 0 is the root, 1..n_cols are the column headers, rows follow. */
+  int *L, *R, *U, *D, *C;
+  int *row;             /* [node] (cell * ns + symbol) of the row it's in */
+  int *size;            /* [column] number of rows left in it */
+  int *stack;           /* [nc] nodes of the rows chosen so far */
+  int n_found;
+  int max_found;
+  int budget;           /* nodes left to visit, or -1 for no limit */
+  int *state;           /* where to put the first solution found */
+};
+/*}}}*/
+
+static void cover(struct dlx *d, int c)/*{{{*/
+{
+  int i, j;
+  d->R[d->L[c]] = d->R[c];
+  d->L[d->R[c]] = d->L[c];
+  for (i = d->D[c]; i != c; i = d->D[i]) {
+    for (j = d->R[i]; j != i; j = d->R[j]) {
+      d->U[d->D[j]] = d->U[j];
+      d->D[d->U[j]] = d->D[j];
+      d->size[d->C[j]]--;
+    }
+  }
+}
+/*}}}*/
+static void uncover(struct dlx *d, int c)/*{{{*/
+{
+  int i, j;
+  for (i = d->U[c]; i != c; i = d->U[i]) {
+    for (j = d->L[i]; j != i; j = d->L[j]) {
+      d->size[d->C[j]]++;
+      d->U[d->D[j]] = j;
+      d->D[d->U[j]] = j;
+    }
+  }
+  d->R[d->L[c]] = c;
+  d->L[d->R[c]] = c;
+}
+/*}}}*/
+static void search(struct dlx *d, int depth)/*{{{*/
+{
+  int c, best, i, j;
+
+  if (d->budget == 0) return;
+  if (d->budget > 0) d->budget--;
+
+  if (d->R[0] == 0) {
+    if (d->n_found == 0) {
+      for (i=0; i<depth; i++) {
+        int r = d->row[d->stack[i]];
+        d->state[r / d->ns] = r % d->ns;
+      }
+    }
+    d->n_found++;
+    return;
+  }
+
+  /* Column with fewest rows left. */
+  best = d->R[0];
+  for (c = d->R[best]; c != 0; c = d->R[c]) {
+    if (d->size[c] < d->size[best]) {
+      best = c;
+      if (d->size[c] < 2) break;
+    }
+  }
+  if (d->size[best] == 0) return;
+
+  cover(d, best);
+  for (i = d->D[best]; i != best; i = d->D[i]) {
+    d->stack[depth] = i;
+    for (j = d->R[i]; j != i; j = d->R[j]) cover(d, d->C[j]);
+    search(d, depth + 1);
+    for (j = d->L[i]; j != i; j = d->L[j]) uncover(d, d->C[j]);
+    if (d->max_found && (d->n_found >= d->max_found)) break;
+    if (d->budget == 0) break;
+  }
+  uncover(d, best);
+}
+/*}}}*/
+int dlx_solve(const struct layout *lay, int *state, int max_solutions, int max_nodes)/*{{{*/
+{
+  /* Count the solutions of 'state', stopping once max_solutions have been
+   * found (0 to count them all).  If there is at least one, the first found is
+   * written into 'state'.  If the search would visit more than max_nodes nodes
+   * (0 for no limit), give up and return -1. */
+  struct dlx d;
+  int nc = lay->nc, ng = lay->ng, ns = lay->ns;
+  unsigned long long *cell_used;  /* [nc] symbols ruled out by the givens in its groups */
+  unsigned long long *group_used; /* [ng] symbols given in each group */
+  int *gs_col;          /* [ng*ns] column of each (group, symbol) still open */
+  int *first_group;     /* [nc+1] cell_groups[first_group[ci]..] are ci's groups */
+  int *cell_groups;     /* [ng*ns] */
+  int n_nodes, n_alloc;
+  int ci, gi, s, k;
+  unsigned long long fill = ~0ULL >> (64 - ns);
+
+  d.n_found = 0;
+  d.ns = ns;
+  d.max_found = max_solutions;
+  d.budget = max_nodes ? max_nodes : -1;
+  d.state = state;
+  d.L = NULL;
+  cell_used = new_array(unsigned long long, nc + ng);
+  group_used = cell_used + nc;
+  gs_col = new_array(int, ng*ns + (nc + 1) + ng*ns);
+  first_group = gs_col + ng*ns;
+  cell_groups = first_group + nc + 1;
+
+  /* Givens; two the same in a group means there's no solution. */
+  memset(cell_used, 0, nc * sizeof(unsigned long long));
+  memset(first_group, 0, (nc + 1) * sizeof(int));
+  for (gi=0; gi<ng; gi++) {
+    unsigned long long used = 0;
+    for (k=0; k<ns; k++) {
+      int sym = state[lay->groups[gi*ns + k]];
+      if (sym >= 0) {
+        if (used & (1ULL<<sym)) goto get_out;
+        used |= (1ULL<<sym);
+      }
+    }
+    group_used[gi] = used;
+    for (k=0; k<ns; k++) {
+      ci = lay->groups[gi*ns + k];
+      cell_used[ci] |= used;
+      first_group[ci + 1]++;
+    }
+  }
+  for (ci=0; ci<nc; ci++) {
+    first_group[ci + 1] += first_group[ci];
+  }
+  for (gi=0; gi<ng; gi++) {
+    for (k=0; k<ns; k++) {
+      ci = lay->groups[gi*ns + k];
+      cell_groups[first_group[ci]++] = gi;
+    }
+  }
+  /* Filling in has moved each start up to the next cell's start. */
+  for (ci=nc; ci>0; ci--) {
+    first_group[ci] = first_group[ci - 1];
+  }
+  first_group[0] = 0;
+
+  /* Only the open part of the matrix is built: columns for the empty cells
+   * and the (group, symbol) pairs not given, rows for the options that the
+   * givens leave open. */
+  d.n_cols = 0;
+  n_alloc = 1;
+  for (ci=0; ci<nc; ci++) {
+    if (state[ci] < 0) {
+      d.n_cols++;
+      n_alloc += 1 + count_bits64(fill & ~cell_used[ci]);
+    }
+  }
+  for (gi=0; gi<ng; gi++) {
+    for (s=0; s<ns; s++) {
+      if (group_used[gi] & (1ULL<<s)) {
+        gs_col[gi*ns + s] = 0;
+      } else {
+        gs_col[gi*ns + s] = ++d.n_cols;
+        /* Header, and at most one node per cell in the group. */
+        n_alloc += 1 + ns;
+      }
+    }
+  }
+  d.L = new_array(int, 6 * n_alloc + (d.n_cols + 1) + nc);
+  d.R = d.L + n_alloc;
+  d.U = d.R + n_alloc;
+  d.D = d.U + n_alloc;
+  d.C = d.D + n_alloc;
+  d.row = d.C + n_alloc;
+  d.size = d.row + n_alloc;
+  d.stack = d.size + (d.n_cols + 1);
+
+  for (k=0; k<=d.n_cols; k++) {
+    d.L[k] = (k == 0) ? d.n_cols : k - 1;
+    d.R[k] = (k == d.n_cols) ? 0 : k + 1;
+    d.U[k] = d.D[k] = d.C[k] = k;
+    d.size[k] = 0;
+  }
+
+  /* The cell columns come first, in cell order. */
+  n_nodes = 1 + d.n_cols;
+  k = 0;
+  for (ci=0; ci<nc; ci++) {
+    int cell_col;
+    if (state[ci] >= 0) continue;
+    cell_col = ++k;
+    for (s=0; s<ns; s++) {
+      int first, j;
+      if (cell_used[ci] & (1ULL<<s)) continue;
+      first = n_nodes;
+      for (j = first_group[ci] - 1; j < first_group[ci + 1]; j++) {
+        int c = (j < first_group[ci]) ? cell_col : gs_col[cell_groups[j]*ns + s];
+        int node = n_nodes++;
+        d.C[node] = c;
+        d.row[node] = ci*ns + s;
+        d.U[node] = d.U[c];
+        d.D[node] = c;
+        d.D[d.U[c]] = node;
+        d.U[c] = node;
+        d.size[c]++;
+        d.L[node] = node - 1;
+        d.R[node] = node + 1;
+      }
+      d.L[first] = n_nodes - 1;
+      d.R[n_nodes - 1] = first;
+    }
+  }
+
+  search(&d, 0);
+  if (d.budget == 0) {
+    d.n_found = -1;
+  }
+
+get_out:
+  free(d.L);
+  free(cell_used);
+  free(gs_col);
+  return d.n_found;
+}
+/*}}}*/
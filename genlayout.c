@@ -17,6 +17,8 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
  */
 
+#include <ctype.h>
+
 #include "sku.h"
 
 static int find_cell_by_yx(struct cell *c, int n, int y, int x)/*{{{*/
@@ -45,11 +47,9 @@ static void seek_and_insert(struct layout *lay, int i, int oy, int ox)/*{{{*/
 {
   int isym = find_cell_by_yx(lay->cells, lay->nc, oy, ox);
   if (isym >= 0) {
-    struct cell *c, *ci;
-    c = lay->cells + i;
-    ci = lay->cells + isym;
-    if (c->isym < ci->isym) ci->isym = c->isym;
-    else                    c->isym = ci->isym;
+    short *s = lay->isym;
+    if (s[i] < s[isym]) s[isym] = s[i];
+    else                s[i] = s[isym];
   }
 }
 /*}}}*/
@@ -69,8 +69,9 @@ void find_symmetries(struct layout *lay, int options)/*{{{*/
   }
 
   /* For searching, we know the cell array is sorted in y-major x-minor order. */
+  lay->isym = new_array(short, NC);
   for (i=0; i<lay->nc; i++) {
-    lay->cells[i].isym = i; /* initial value. */
+    lay->isym[i] = i; /* initial value. */
   }
 
   /* TODO : other logic in here to deal with other symmetry modes */
@@ -113,22 +114,196 @@ void find_symmetries(struct layout *lay, int options)/*{{{*/
   /* Now find equivalence classes : by working upwards, everything gets locked
    * to the lowest index in the same class. */
   for (i=0; i<NC; i++) {
-    lay->cells[i].isym = lay->cells[lay->cells[i].isym].isym;
+    lay->isym[i] = lay->isym[lay->isym[i]];
   }
 
   /* Now generate rings. */
   for (i=0; i<NC; i++) {
-    if (lay->cells[i].isym == i) { /* root of this class. */
+    if (lay->isym[i] == i) { /* root of this class. */
       int j;
       int prev = i;
       for (j=i+1; j<NC; j++) {
-        if (lay->cells[j].isym == i) {
-          lay->cells[prev].isym = j;
+        if (lay->isym[j] == i) {
+          lay->isym[prev] = j;
           prev = j;
         }
       }
-      lay->cells[prev].isym = i;
+      lay->isym[prev] = i;
+    }
+  }
+}
+/*}}}*/
+void find_cell_groups(struct layout *lay)/*{{{*/
+{
+  /* Index the groups each cell is in from the cells in each group, so that
+   * a cell can be in any number of them.  They are listed in the order of
+   * their numbers. */
+  int *next;
+  int gi, j, ic, n;
+  int NS = lay->ns;
+  lay->cell_group_index = new_array(int, lay->nc + 1);
+  memset(lay->cell_group_index, 0, (lay->nc + 1) * sizeof(int));
+  for (j=0; j<lay->ng*NS; j++) {
+    ++lay->cell_group_index[lay->groups[j] + 1];
+  }
+  for (ic=0; ic<lay->nc; ic++) {
+    lay->cell_group_index[ic + 1] += lay->cell_group_index[ic];
+  }
+  n = lay->cell_group_index[lay->nc];
+  lay->cell_groups = new_array(short, n > 0 ? n : 1);
+  next = new_array(int, lay->nc);
+  memcpy(next, lay->cell_group_index, lay->nc * sizeof(int));
+  for (gi=0; gi<lay->ng; gi++) {
+    for (j=0; j<NS; j++) {
+      lay->cell_groups[next[lay->groups[gi*NS + j]]++] = gi;
+    }
+  }
+  free(next);
+}
+/*}}}*/
+static int list_peers(struct layout *lay, int *seen, int fill)/*{{{*/
+{
+  int ic, k, j;
+  int NS = lay->ns;
+  int n = 0;
+  for (ic=0; ic<lay->nc; ic++) seen[ic] = -1;
+  for (ic=0; ic<lay->nc; ic++) {
+    seen[ic] = ic;
+    for (k=lay->cell_group_index[ic]; k<lay->cell_group_index[ic+1]; k++) {
+      int gg = lay->cell_groups[k];
+      if (fill) lay->peer_index[k] = n;
+      for (j=0; j<NS; j++) {
+        int jc = lay->groups[gg*NS + j];
+        if (seen[jc] != ic) {
+          seen[jc] = ic;
+          if (fill) lay->peers[n] = jc;
+          n++;
+        }
+      }
+    }
+  }
+  if (fill) lay->peer_index[lay->cell_group_index[lay->nc]] = n;
+  return n;
+}
+/*}}}*/
+void find_peers(struct layout *lay)/*{{{*/
+{
+  /* Build the peer lists, so that placing a symbol visits each cell that
+   * shares a group with it once, however many groups they share.  (Cells in
+   * the overlaps of gattai layouts share up to 4.)  The lists are split by
+   * the cell's groups so that they are visited in the same order as a walk
+   * over the groups would. */
+  int *seen;
+  int n;
+  seen = new_array(int, lay->nc);
+  n = list_peers(lay, seen, 0);
+  lay->peer_index = new_array(int, lay->cell_group_index[lay->nc] + 1);
+  lay->peers = new_array(short, n > 0 ? n : 1);
+  list_peers(lay, seen, 1);
+  free(seen);
+}
+/*}}}*/
+static int list_intersections(struct layout *lay, unsigned long long *mask, int fill)/*{{{*/
+{
+  /* mask[gj] and other are the cells that group gi has in common with gj, as
+   * positions within gi and gj respectively. */
+  int gi, gj, j, k;
+  int NS = lay->ns;
+  int n = 0;
+  for (gi=0; gi<lay->ng; gi++) {
+    memset(mask, 0, lay->ng * sizeof(unsigned long long));
+    for (j=0; j<NS; j++) {
+      int ic = lay->groups[gi*NS + j];
+      for (k=lay->cell_group_index[ic]; k<lay->cell_group_index[ic+1]; k++) {
+        int gk = lay->cell_groups[k];
+        if (gk != gi) mask[gk] |= 1ULL<<j;
+      }
+    }
+    if (fill) lay->isect_index[gi] = n;
+    for (gj=0; gj<lay->ng; gj++) {
+      if (mask[gj]) {
+        if (fill) {
+          unsigned long long other = 0;
+          for (j=0; j<NS; j++) {
+            int ic = lay->groups[gj*NS + j];
+            for (k=lay->cell_group_index[ic]; k<lay->cell_group_index[ic+1]; k++) {
+              if (lay->cell_groups[k] == gi) other |= 1ULL<<j;
+            }
+          }
+          lay->isect_group[n] = gj;
+          lay->isect_mask[n] = mask[gj];
+          lay->isect_other[n] = other;
+        }
+        n++;
+      }
+    }
+  }
+  if (fill) lay->isect_index[lay->ng] = n;
+  return n;
+}
+/*}}}*/
+void find_intersections(struct layout *lay)/*{{{*/
+{
+  /* For each group, the groups it shares cells with and which cells those
+   * are, so that try_subsets() can look for a symbol confined to an
+   * intersection without scanning every group in the layout. */
+  unsigned long long *mask;
+  int n;
+  mask = new_array(unsigned long long, lay->ng);
+  n = list_intersections(lay, mask, 0);
+  lay->isect_index = new_array(int, lay->ng + 1);
+  lay->isect_group = new_array(short, n > 0 ? n : 1);
+  lay->isect_mask = new_array(unsigned long long, n > 0 ? n : 1);
+  lay->isect_other = new_array(unsigned long long, n > 0 ? n : 1);
+  list_intersections(lay, mask, 1);
+  free(mask);
+}
+/*}}}*/
+int plain_9x9_p(const struct layout *lay)/*{{{*/
+{
+  /* Whether bb9.c can solve the layout: it has to be the standard 9x9 one
+   * with the cells in raster order, so its groups must be exactly the rows,
+   * the columns and the 3x3 blocks (in any order.) */
+  char seen[27];
+  int gi, j;
+  if ((lay->ns != 9) || (lay->nc != 81) || (lay->ng != 27)) return 0;
+  memset(seen, 0, sizeof(seen));
+  for (gi=0; gi<27; gi++) {
+    const short *base = lay->groups + 9*gi;
+    int row = base[0] / 9, col = base[0] % 9;
+    int block = 3*(row / 3) + (col / 3);
+    int in_row = 0, in_col = 0, in_block = 0;
+    int kind;
+    for (j=0; j<9; j++) {
+      int r = base[j] / 9, c = base[j] % 9;
+      if (r == row) in_row |= 1 << c;
+      if (c == col) in_col |= 1 << r;
+      if (3*(r / 3) + (c / 3) == block) in_block |= 1 << (3*(r % 3) + (c % 3));
     }
+    if (in_row == 0x1ff) kind = row;
+    else if (in_col == 0x1ff) kind = 9 + col;
+    else if (in_block == 0x1ff) kind = 18 + block;
+    else return 0;
+    if (seen[kind]) return 0;
+    seen[kind] = 1;
+  }
+  return 1;
+}
+/*}}}*/
+void find_overlap_cells(struct layout *lay)/*{{{*/
+{
+  /* So that speculation can try the cells shared between subgrids first
+   * without looking at every cell. */
+  int i, n;
+  n = 0;
+  for (i=0; i<lay->nc; i++) {
+    if (lay->is_overlap[i]) n++;
+  }
+  lay->n_overlap = n;
+  lay->overlap_cells = new_array(short, n > 0 ? n : 1);
+  n = 0;
+  for (i=0; i<lay->nc; i++) {
+    if (lay->is_overlap[i]) lay->overlap_cells[n++] = i;
   }
 }
 /*}}}*/
@@ -144,22 +319,17 @@ void debug_layout(struct layout *lay)/*{{{*/
         lay->cells[i].pcol,
         lay->cells[i].rrow,
         lay->cells[i].rcol,
-        lay->cells[i].is_overlap ? "OVER" : "    ",
+        lay->is_overlap[i] ? "OVER" : "    ",
         lay->cells[i].name);
-    for (j=0; j<NDIM; j++) {
-      int kk = lay->cells[i].group[j];
-      if (kk >= 0) {
-        fprintf(stderr, " %d", kk);
-      } else {
-        break;
-      }
+    for (j=lay->cell_group_index[i]; j<lay->cell_group_index[i+1]; j++) {
+      fprintf(stderr, " %d", lay->cell_groups[j]);
     }
-    j = lay->cells[i].isym;
+    j = lay->isym[i];
     fprintf(stderr, "  SYM :");
     count = 0;
     while (j != i) {
       fprintf(stderr, " %s", lay->cells[j].name);
-      j = lay->cells[j].isym;
+      j = lay->isym[j];
       count++;
       if (count > 8) {
         fprintf(stderr, "\nINFINITE LOOP!\n");
@@ -171,25 +341,49 @@ void debug_layout(struct layout *lay)/*{{{*/
 }
 /*}}}*/
 
-static void parse_mn(const char *x, int len, int *M, int *N)/*{{{*/
+static int parse_number(const char *x, int len)/*{{{*/
+{
+  int i, n;
+  if (len < 1) return -1;
+  n = 0;
+  for (i=0; i<len; i++) {
+    if (!isdigit((unsigned char) x[i])) return -1;
+    n = 10*n + (x[i] - '0');
+    if (n > MAX_SYMBOLS) return -1;
+  }
+  return n;
+}
+/*}}}*/
+void parse_mn(const char *x, int len, int *M, int *N)/*{{{*/
 {
-  switch (len) {
-    case 1:
-      *M = *N = x[0] - '0';
-      break;
-    case 2:
-      *M = x[0] - '0';
-      *N = x[1] - '0';
-      break;
-    default:
-      fprintf(stderr, "Can't parse rows and columns from %s\n", x);
-      exit(1);
-      break;
+  /* "3" for 3x3 blocks, "23" for 2x3, or "M,N" for sizes of more than one
+   * digit. */
+  const char *comma = memchr(x, ',', len);
+  if (comma) {
+    *M = parse_number(x, comma - x);
+    *N = parse_number(comma + 1, len - (comma + 1 - x));
+  } else if (len == 1) {
+    *M = *N = parse_number(x, 1);
+  } else if (len == 2) {
+    *M = parse_number(x, 1);
+    *N = parse_number(x + 1, 1);
+  } else {
+    *M = *N = -1;
+  }
+  if ((*M < 1) || (*N < 1)) {
+    fprintf(stderr, "Can't parse rows and columns from %.*s\n", len, x);
+    exit(1);
+  }
+  if (*M * *N > MAX_SYMBOLS) {
+    fprintf(stderr, "Layout %.*s has more than %d symbols\n", len, x, MAX_SYMBOLS);
+    exit(1);
   }
 }
 /*}}}*/
 static void make_super(const char *x, struct super_layout *superlay)/*{{{*/
 {
+  superlay->n_groups = 0;
+  superlay->groups = NULL;
   if (!strcmp(x, "5")) {
     superlayout_5(superlay);
   } else if (!strcmp(x, "8")) {
@@ -215,6 +409,11 @@ struct layout *genlayout(const char *name, int options)/*{{{*/
 
   result = new(struct layout);
 
+  if (*name == '@') {
+    load_layout_file(name + 1, result, options);
+    result->name = strdup(name);
+    return result;
+  }
   if (*name == 'x') {
     x_layout = 1;
     name1 = name + 1;
@@ -240,3 +439,56 @@ struct layout *genlayout(const char *name, int options)/*{{{*/
   return result;
 }
 /*}}}*/
+
+/* ============================================================================ */
+
+/* Layouts are immutable once built, so when many grids share the same
+ * '#layout:' header there is no point in regenerating the tables for each one.
+ * The symmetry options change the isym rings, so they form part of the key. */
+
+struct layout_cache {/*{{{*/
+  char *name;
+  int sym_options;
+  struct layout *lay;
+  struct layout_cache *next;
+};
+/*}}}*/
+
+static struct layout_cache *layout_cache = NULL;
+
+struct layout *find_layout(const char *name, int options)/*{{{*/
+{
+  struct layout_cache *lc, **plc;
+  int sym_options = options & OPT_SYM_MASK;
+
+  for (plc = &layout_cache; (lc = *plc); plc = &lc->next) {
+    if ((lc->sym_options == sym_options) && !strcmp(lc->name, name)) {
+      /* Move to front : a batch usually repeats the same layout. */
+      *plc = lc->next;
+      lc->next = layout_cache;
+      layout_cache = lc;
+      return lc->lay;
+    }
+  }
+
+  lc = new(struct layout_cache);
+  lc->name = strdup(name);
+  lc->sym_options = sym_options;
+  lc->lay = genlayout(name, options);
+  lc->next = layout_cache;
+  layout_cache = lc;
+  return lc->lay;
+}
+/*}}}*/
+void free_layout_cache(void)/*{{{*/
+{
+  struct layout_cache *lc, *nlc;
+  for (lc = layout_cache; lc; lc = nlc) {
+    nlc = lc->next;
+    free_layout(lc->lay);
+    free(lc->name);
+    free(lc);
+  }
+  layout_cache = NULL;
+}
+/*}}}*/
@@ -19,24 +19,26 @@
 
 #include "sku.h"
 
-void grade(int options)/*{{{*/
+static void grade_grid(struct context *ctx, struct layout *lay, int *state, const struct op_args *args)/*{{{*/
 {
-  struct layout *lay;
-  int *state;
+  int options = args->options;
   int *copy;
   struct constraint cons;
   int xl, xs, xo, xp, rxp;
+  int max_xp;
 
-  read_grid(&lay, &state, options);
   copy = new_array(int, lay->nc);
+  /* No group can have a partition bigger than half its symbols */
+  max_xp = (lay->ns + 1) >> 1;
+  if (max_xp > PARTITION_SIZE_LIMIT) max_xp = PARTITION_SIZE_LIMIT;
 
-  printf("Available methods             Reqd partition size\n");
-  printf("-----------------             -------------------\n");
+  fprintf(ctx->out, "Available methods             Reqd partition size\n");
+  fprintf(ctx->out, "-----------------             -------------------\n");
   for (xl=0; xl<=1; xl++) {
     for (xs=0; xs<=1; xs++) {
       for (xo=0; xo<=1; xo++) {
         rxp = -1;   
-        for (xp=0; xp<=MAX_PARTITION_SIZE; xp++) {
+        for (xp=0; xp<=max_xp; xp++) {
           if (xp == 1) continue;
           int n_sol;
           memcpy(copy, state, lay->nc * sizeof(int));
@@ -44,28 +46,31 @@ void grade(int options)/*{{{*/
           cons.do_subsets = xs;
           cons.do_onlyopt = xo;
           cons.max_partition_size = xp;
-          n_sol = infer(lay, copy, NULL, NULL, &cons, options);
+          n_sol = infer(ctx, lay, copy, NULL, NULL, NULL, &cons, options);
           if (n_sol == 1) {
             rxp = xp;
             break;
           }
         }
-        printf("%s ", xl ? "Lines   " : "        ");
-        printf("%s ", xs ? "Subsets " : "        ");
-        printf("%s ", xo ? "Onlyopt " : "        ");
+        fprintf(ctx->out, "%s ", xl ? "Lines   " : "        ");
+        fprintf(ctx->out, "%s ", xs ? "Subsets " : "        ");
+        fprintf(ctx->out, "%s ", xo ? "Onlyopt " : "        ");
         if (rxp < 0) {
-          printf(" : NO SOLUTION\n");
+          fprintf(ctx->out, " : NO SOLUTION\n");
         } else if (rxp == 0) {
-          printf(" : 0\n");
+          fprintf(ctx->out, " : 0\n");
         } else {
-          printf(" : >= %d\n", rxp);
+          fprintf(ctx->out, " : >= %d\n", rxp);
         }
       }
     }
   }
 
   free(copy);
-  free(state);
-  free_layout(lay);
+}
+/*}}}*/
+void grade(const struct op_args *args)/*{{{*/
+{
+  for_each_grid(grade_grid, args);
 }
 /*}}}*/
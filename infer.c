@@ -19,18 +19,48 @@
 
 #include "sku.h"
 
+/* Candidate sets have one bit per symbol (or per position in a group).  This
+ * file is compiled three times: as it stands, for layouts whose sets fit in an
+ * unsigned int; with WIDE_SETS defined, as infer_wide(), for the bigger ones
+ * (up to MAX_SYMBOLS); and with NARROW_SETS defined, as infer_narrow(), for
+ * those of up to 16 symbols, which then take half the room.  infer() hands
+ * both kinds over. */
+#ifdef WIDE_SETS
+typedef unsigned long long SYMSET;
+#define set_count count_bits64
+#define set_first decode64
+#define infer infer_wide
+#define free_plans free_plans_wide
+#define fewest_candidates fewest_candidates_wide
+#define PLANS(ctx) ((ctx)->wide_plans)
+#elif defined(NARROW_SETS)
+typedef unsigned short SYMSET;
+#define set_count count_bits
+#define set_first decode
+#define infer infer_narrow
+#define free_plans free_plans_narrow
+#define fewest_candidates fewest_candidates_narrow
+#define PLANS(ctx) ((ctx)->narrow_plans)
+#else
+typedef unsigned int SYMSET;
+#define set_count count_bits
+#define set_first decode
+#define PLANS(ctx) ((ctx)->plans)
+#endif
+#define SET_BITS (8 * (int) sizeof(SYMSET))
+#define BIT(i) ((SYMSET) 1 << (i))
+#define FILL(n) ((SYMSET) ~(SYMSET) 0 >> (SET_BITS - (n)))
+
 /* ============================================================================ */
 
 struct ws;
-struct queue;
-
-struct link {/*{{{*/
-  /* Node for holding a cell or group index in a queue. */
-  struct link *next;
-  struct link *prev;
-  int index;
-  struct queue *q; /* which queue the link is on, NULL o/w */
-  struct queue *base_q; /* which queue the link has to go back to when its resouce is updated. */
+
+struct members {/*{{{*/
+  /* The groups (or the cells) as far as the queues are concerned.  Each is on
+   * at most one queue at a time; clearing every queue is a memset of 'on'. */
+  int n;
+  signed char *on;      /* [n] id of the queue each one is on, -1 if none */
+  unsigned int *ticket; /* [n] its position in that queue's ring */
 };
 /*}}}*/
 
@@ -42,96 +72,136 @@ struct score {
 /* Returns -1 if an error has been detected,
  * 0 if no work got done,
  * 1 if work was done. */
-typedef int (*WORKER)(int, struct layout *, struct ws *, int, struct score *score);
+typedef int (*WORKER)(int, const struct layout *, struct ws *, int, struct score *score);
   
 struct queue {/*{{{*/
-  struct link links; /* .index ignored */
+  /* A FIFO ring of group or cell indices.  Moving something to another queue
+   * leaves its old entry behind: an entry only counts if the index is still
+   * on this queue with the same ticket (the position it was pushed at).  The
+   * ring has room for twice as many entries as there are members, so
+   * squeezing out the dead entries when it fills always frees up at least
+   * half of it. */
+  int *ring;
+  unsigned int mask;
+  unsigned int head;
+  unsigned int tail;
+  int id;
+  struct members *m;
   struct queue *next_to_run;
   struct queue *next_to_push;
   int opt;
-  char *name;
+  char name[24];
   WORKER worker;
 };
 /*}}}*/
-static struct queue *mk_queue(WORKER worker, struct queue *next_to_run, struct queue *next_to_push, int opt, char *name)/*{{{*/
+static struct queue *mk_queue(WORKER worker, struct queue *next_to_run, struct queue *next_to_push, int opt, const char *name,
+    struct members *m, int id)/*{{{*/
 {
   struct queue *x;
+  unsigned int size;
   x = new(struct queue);
-  x->links.next = x->links.prev = &x->links;
+  size = 16;
+  while (size < 2 * m->n) size <<= 1;
+  x->ring = new_array(int, size);
+  x->mask = size - 1;
+  x->head = x->tail = 0;
+  x->id = id;
+  x->m = m;
   x->worker = worker;
   x->next_to_run = next_to_run;
   x->next_to_push = next_to_push;
   x->opt = opt;
-  x->name = strdup(name);
+  snprintf(x->name, sizeof(x->name), "%s", name);
   return x;
 }
 /*}}}*/
 static void free_queue(struct queue *x)/*{{{*/
 {
-  free(x->name);
+  free(x->ring);
   free(x);
 }
 /*}}}*/
-static struct link *dequeue(struct queue *q) /*{{{*/
+static void compact_queue(struct queue *q)/*{{{*/
 {
-  struct link *base, *first;
-  base = &q->links;
-  first = base->next;
-  if (first == base) {
-    /* Empty queue */
-    return NULL;
+  /* Squeeze out the entries for things that have moved on, keeping the order
+   * of the rest. */
+  struct members *m = q->m;
+  unsigned int t, to;
+  to = q->head;
+  for (t = q->head; t != q->tail; t++) {
+    int i = q->ring[t & q->mask];
+    if ((m->on[i] == q->id) && (m->ticket[i] == t)) {
+      q->ring[to & q->mask] = i;
+      m->ticket[i] = to;
+      to++;
+    }
+  }
+  q->tail = to;
+}
+/*}}}*/
+static void push_queue(struct queue *q, int i)/*{{{*/
+{
+  if (q->tail - q->head > q->mask) {
+    compact_queue(q);
+  }
+  q->ring[q->tail & q->mask] = i;
+  q->m->on[i] = q->id;
+  q->m->ticket[i] = q->tail;
+  q->tail++;
+}
+/*}}}*/
+static int dequeue(struct queue *q) /*{{{*/
+{
+  /* The index at the front of the queue, or -1 if it's empty. */
+  struct members *m = q->m;
+  while (q->head != q->tail) {
+    unsigned int t = q->head++;
+    int i = q->ring[t & q->mask];
+    if ((m->on[i] == q->id) && (m->ticket[i] == t)) {
+      m->on[i] = -1;
+      return i;
+    }
   }
-  first->next->prev = base;
-  base->next = first->next;
-  first->next = first->prev = first;
-  first->q = NULL;
-  return first;
+  return -1;
 }
 /*}}}*/
-static void enqueue(struct link *lk, struct queue *q)/*{{{*/
+static void enqueue(int i, struct queue *q)/*{{{*/
 {
-  struct link *base;
-  if (lk->q) {
-    fprintf(stderr, "Can't enqueue %d, it's already on a queue!!\n", lk->index);
+  if (q->m->on[i] >= 0) {
+    fprintf(stderr, "Can't enqueue %d, it's already on a queue!!\n", i);
     exit(2);
   }
-  base = &q->links;
-  lk->prev = base->prev;
-  lk->next = base;
-  base->prev->next = lk;
-  base->prev = lk;
-  lk->q = q;
+  push_queue(q, i);
 }
 /*}}}*/
-static void move_to_queue(struct link *lk, struct queue *to_q)/*{{{*/
+static void move_to_queue(int i, struct queue *to_q)/*{{{*/
 {
-  struct link *base;
-  if (lk->q == to_q) {
+  if (to_q->m->on[i] == to_q->id) {
     return;
   }
-
-  /* Take off old queue. */
-  if (lk->q) {
-    lk->next->prev = lk->prev;
-    lk->prev->next = lk->next;
-  }
-  /* Push onto new queue */
-  base = &to_q->links;
-  lk->prev = base->prev;
-  lk->next = base;
-  lk->q = to_q;
-  base->prev->next = lk;
-  base->prev = lk;
+  push_queue(to_q, i);
 }
 /*}}}*/
 
 /* ============================================================================ */
 
+struct trail_entry {/*{{{*/
+  SYMSET *where;        /* the poss or todo entry changed, or NULL for a state */
+  SYMSET old;
+  int cell;             /* the cell whose poss or state it is, or -1 */
+  signed char old_state;
+};
+/*}}}*/
+/* Below this many cells, scanning the grid for the cell to guess is cheaper
+ * than keeping the cells filed by their number of candidates. */
+#define FILE_CELLS_MIN 256
+#define WORD_BITS (8 * (int) sizeof(unsigned long))
+
 struct ws {/*{{{*/
   int nc, ng, ns;
 
-  int *poss;
-  int *todo;
+  SYMSET *poss;
+  SYMSET *todo;
   int solvepos;
   int spec_depth;
   int n_todo;
@@ -139,80 +209,157 @@ struct ws {/*{{{*/
   double score;
 
   /* Pointers/values passed in at the outer level. */
+  struct context *ctx;
+  const struct constraint *cons;
   int options;
   int *order;
-  
-  int *state;
+  char *terminal;
+
+  /* The grid, in a copy of the caller's state[] that is a byte per cell, so
+   * that it is cheap to scan and to copy for another thread. */
+  signed char *state;
 
   /* Queues for what to scan next. */
   struct queue *base_q;
   struct queue *base_cell_q;
   struct queue *base_line_q;
   struct queue *base_block_q;
-  struct link *group_links;
-  struct link *cell_links;
+  struct members groups;
+  struct members cells;
+
+  /* Innermost parallel speculation this workspace is solving a branch of
+   * (NULL if none), and which branch. */
+  struct spec_frame *frame;
+  int branch;
+
+  /* Old values of everything in poss/todo/state changed while speculating,
+   * so that a guess can be backed out. */
+  struct trail_entry *trail;
+  int n_trail;
+  int max_trail;
+
+  /* The open cells filed by how many candidates they have left, so that
+   * speculation can pick the next cell to guess without a scan.  Only kept
+   * up once speculation first needs it (cells_filed), and only on big
+   * layouts. */
+  int cells_filed;
+  int n_words;
+  unsigned long *filed;       /* [(ns+1)*n_words] a bitmap of cells per count */
+  int *n_filed;               /* [ns+1] cells in each bitmap */
+  int *n_filed_overlap;       /* [ns+1] ... and how many of them are overlap cells */
+  signed char *filed_as;      /* [nc] count each cell is filed under, or -1 */
+  unsigned long *overlap;     /* [n_words] the layout's overlap cells */
+  const char *is_overlap;     /* [nc] lay->is_overlap */
+
+  /* A group goes through the partition queues one size after another with
+   * nothing changing in between, so try_partition() keeps the maps it works
+   * out for each group.  They are good while built after the group was last
+   * requeued, and after anything was last backed out.  The stamps are values
+   * of part_clock, which moves on each time a group's maps are built. */
+  long part_clock;
+  long maps_stale;
+  long *group_changed;        /* [ng] */
+  long *maps_built;           /* [ng] */
+  int *part_index;            /* [ng*2*ns] cmap, smap (see struct partition) */
+  SYMSET *part_sets;          /* [ng*2*ns] fposs, rposs */
 };
 /*}}}*/
-static struct ws *make_ws(int nc, int ng, int ns)/*{{{*/
+static void init_members(struct members *m, int n)/*{{{*/
 {
-  struct ws *ws = new(struct ws);
-  int fill;
+  m->n = n;
+  m->on = new_array(signed char, n);
+  m->ticket = new_array(unsigned int, n);
+  memset(m->on, -1, n);
+}
+/*}}}*/
+static void make_members(struct ws *ws)/*{{{*/
+{
+  init_members(&ws->groups, ws->ng);
+  init_members(&ws->cells, ws->nc);
+}
+/*}}}*/
+static void free_members(struct members *m)/*{{{*/
+{
+  free(m->on);
+  free(m->ticket);
+}
+/*}}}*/
+static void init_filing(struct ws *ws)/*{{{*/
+{
+  ws->cells_filed = 0;
+  ws->filed = NULL;
+  ws->n_filed = NULL;
+  ws->n_filed_overlap = NULL;
+  ws->filed_as = NULL;
+  ws->overlap = NULL;
+  ws->is_overlap = NULL;
+}
+/*}}}*/
+static void init_part_maps(struct ws *ws)/*{{{*/
+{
+  ws->part_clock = 0;
+  ws->maps_stale = 0;
+  ws->group_changed = NULL;
+  ws->maps_built = NULL;
+  ws->part_index = NULL;
+  ws->part_sets = NULL;
+}
+/*}}}*/
+static void reset_ws(struct ws *ws)/*{{{*/
+{
+  /* Back to the state for an empty grid.  (The queues are dealt with
+   * separately.) */
+  SYMSET fill;
   int i;
 
-  ws->nc = nc;
-  ws->ng = ng;
-  ws->ns = ns;
+  fill = FILL(ws->ns);
   ws->spec_depth = 0;
-
-  fill = (1<<ns) - 1;
-  ws->todo = new_array(int, ng);
-  ws->poss = new_array(int, nc);
+  ws->solvepos = 0;
   ws->n_todo = 0;
   ws->n_marked_todo = -1;
   ws->score = 0.0;
-  for (i=0; i<ng; i++) ws->todo[i] = fill;
-  for (i=0; i<nc; i++) ws->poss[i] = fill;
+  for (i=0; i<ws->ng; i++) ws->todo[i] = fill;
+  for (i=0; i<ws->nc; i++) ws->poss[i] = fill;
+  ws->frame = NULL;
+  ws->branch = 0;
+  ws->n_trail = 0;
+  ws->cells_filed = 0;
+  ws->maps_stale = ws->part_clock;
+}
+/*}}}*/
+static struct ws *make_ws(int nc, int ng, int ns)/*{{{*/
+{
+  struct ws *ws = new(struct ws);
 
-  ws->group_links = new_array(struct link, ng);
-  for (i=0; i<ng; i++) {
-    ws->group_links[i].next = ws->group_links[i].prev = &ws->group_links[i];
-    ws->group_links[i].index = i;
-    ws->group_links[i].q = NULL;
-  }
-  ws->cell_links = new_array(struct link, nc);
-  for (i=0; i<nc; i++) {
-    ws->cell_links[i].next = ws->cell_links[i].prev = &ws->cell_links[i];
-    ws->cell_links[i].index = i;
-    ws->cell_links[i].q = NULL;
-  }
+  ws->nc = nc;
+  ws->ng = ng;
+  ws->ns = ns;
+  ws->todo = new_array(SYMSET, ng);
+  ws->poss = new_array(SYMSET, nc);
+  ws->state = new_array(signed char, nc);
+  make_members(ws);
+  ws->trail = NULL;
+  ws->max_trail = 0;
+  init_filing(ws);
+  init_part_maps(ws);
+  reset_ws(ws);
 
   return ws;
 }
 /*}}}*/
-static void set_base_queues(const struct layout *lay, struct ws *ws)/*{{{*/
+static signed char *copy_states(int n, const signed char *data)/*{{{*/
 {
-  int gi, ci;
-  for (gi=0; gi<lay->ng; gi++) {
-    struct link *x;
-    x = ws->group_links + gi;
-    if (lay->is_block[gi]) {
-      x->base_q = ws->base_block_q;
-    } else {
-      x->base_q = ws->base_line_q;
-    }
-  }
-  for (ci=0; ci<lay->nc; ci++) {
-    struct link *x;
-    x = ws->cell_links + ci;
-    x->base_q = ws->base_cell_q;
-  }
+  signed char *result;
+  result = new_array(signed char, n);
+  memcpy(result, data, n);
+  return result;
 }
 /*}}}*/
-static int *copy_array(int n, int *data)/*{{{*/
+static SYMSET *copy_sets(int n, const SYMSET *data)/*{{{*/
 {
-  int *result;
-  result = new_array(int, n);
-  memcpy(result, data, n * sizeof(int));
+  SYMSET *result;
+  result = new_array(SYMSET, n);
+  memcpy(result, data, n * sizeof(SYMSET));
   return result;
 }
 /*}}}*/
@@ -227,10 +374,13 @@ static struct ws *clone_ws(const struct ws *src)/*{{{*/
   ws->n_todo = src->n_todo;
   ws->n_marked_todo = src->n_marked_todo;
   ws->solvepos = src->solvepos;
-  ws->poss = copy_array(src->nc, src->poss); 
-  ws->todo = copy_array(src->ng, src->todo);
+  ws->poss = copy_sets(src->nc, src->poss); 
+  ws->todo = copy_sets(src->ng, src->todo);
+  ws->ctx = src->ctx;
+  ws->cons = src->cons;
   ws->options = src->options;
   ws->order = src->order;
+  ws->terminal = src->terminal;
   ws->state = NULL;
   ws->score = 0.0;
 
@@ -240,36 +390,146 @@ static struct ws *clone_ws(const struct ws *src)/*{{{*/
   ws->base_cell_q = src->base_cell_q;
   ws->base_line_q = src->base_line_q;
   ws->base_block_q = src->base_block_q;
-  ws->group_links = src->group_links;
-  ws->cell_links = src->cell_links;
+  ws->groups = src->groups;
+  ws->cells = src->cells;
+  ws->frame = src->frame;
+  ws->branch = src->branch;
+  ws->trail = NULL;
+  ws->n_trail = ws->max_trail = 0;
+  init_filing(ws);
+  init_part_maps(ws);
   
   return ws;
 }
 /*}}}*/
-static void free_cloned_ws(struct layout *lay, struct ws *ws)/*{{{*/
+static void clear_queues(const struct layout *lay, struct ws *ws)/*{{{*/
 {
+  /* Empty the queues after backing out of a guess; they are always empty
+   * when speculation starts. */
   struct queue *q;
-  int i;
   
-  /* Clean queues. */
-  q = ws->base_q;
-  while (q) {
-    struct link *lk = &q->links;
-    lk->next = lk->prev = lk;
-    q = q->next_to_run;
+  for (q = ws->base_q; q; q = q->next_to_run) {
+    q->head = q->tail = 0;
   }
-  for (i=0; i<lay->ng; i++) {
-    struct link *lk = ws->group_links + i;
-    lk->q = NULL;
+  memset(ws->groups.on, -1, ws->groups.n);
+  memset(ws->cells.on, -1, ws->cells.n);
+}
+/*}}}*/
+static void refile_cell(struct ws *ws, int ic)/*{{{*/
+{
+  /* Move the cell to the bitmap for its current number of candidates. */
+  int was = ws->filed_as[ic];
+  int now = (ws->state[ic] < 0) ? set_count(ws->poss[ic]) : -1;
+  unsigned long bit = 1UL << (ic % WORD_BITS);
+  int w = ic / WORD_BITS;
+  if (now == was) return;
+  if (was >= 0) {
+    ws->filed[was*ws->n_words + w] &= ~bit;
+    --ws->n_filed[was];
+    if (ws->is_overlap[ic]) --ws->n_filed_overlap[was];
   }
-  for (i=0; i<lay->nc; i++) {
-    struct link *lk = ws->cell_links + i;
-    lk->q = NULL;
+  if (now >= 0) {
+    ws->filed[now*ws->n_words + w] |= bit;
+    ++ws->n_filed[now];
+    if (ws->is_overlap[ic]) ++ws->n_filed_overlap[now];
   }
-  
-  free(ws->poss);
-  free(ws->todo);
-  free(ws);
+  ws->filed_as[ic] = now;
+}
+/*}}}*/
+static void file_cells(const struct layout *lay, struct ws *ws)/*{{{*/
+{
+  int i;
+  if (!ws->filed) {
+    ws->n_words = (ws->nc + WORD_BITS - 1) / WORD_BITS;
+    ws->filed = new_array(unsigned long, (ws->ns + 1) * ws->n_words);
+    ws->n_filed = new_array(int, ws->ns + 1);
+    ws->n_filed_overlap = new_array(int, ws->ns + 1);
+    ws->filed_as = new_array(signed char, ws->nc);
+    ws->overlap = new_array(unsigned long, ws->n_words);
+    memset(ws->overlap, 0, ws->n_words * sizeof(unsigned long));
+    for (i=0; i<ws->nc; i++) {
+      if (lay->is_overlap[i]) ws->overlap[i / WORD_BITS] |= 1UL << (i % WORD_BITS);
+    }
+    ws->is_overlap = lay->is_overlap;
+  }
+  memset(ws->filed, 0, (ws->ns + 1) * ws->n_words * sizeof(unsigned long));
+  memset(ws->n_filed, 0, (ws->ns + 1) * sizeof(int));
+  memset(ws->n_filed_overlap, 0, (ws->ns + 1) * sizeof(int));
+  for (i=0; i<ws->nc; i++) {
+    ws->filed_as[i] = -1;
+    refile_cell(ws, i);
+  }
+  ws->cells_filed = 1;
+}
+/*}}}*/
+static void free_filing(struct ws *ws)/*{{{*/
+{
+  free(ws->filed);
+  free(ws->n_filed);
+  free(ws->n_filed_overlap);
+  free(ws->filed_as);
+  free(ws->overlap);
+}
+/*}}}*/
+static struct trail_entry *add_trail(struct ws *ws, int cell)/*{{{*/
+{
+  struct trail_entry *e;
+  if (ws->n_trail == ws->max_trail) {
+    struct trail_entry *nt;
+    ws->max_trail = ws->max_trail ? 2 * ws->max_trail : 1024;
+    nt = new_array(struct trail_entry, ws->max_trail);
+    if (ws->n_trail) {
+      memcpy(nt, ws->trail, ws->n_trail * sizeof(struct trail_entry));
+    }
+    free(ws->trail);
+    ws->trail = nt;
+  }
+  e = ws->trail + ws->n_trail++;
+  e->cell = cell;
+  return e;
+}
+/*}}}*/
+static void trail_write(struct ws *ws, SYMSET *where, SYMSET value, int cell)/*{{{*/
+{
+  if (ws->spec_depth > 0) {
+    struct trail_entry *e = add_trail(ws, cell);
+    e->where = where;
+    e->old = *where;
+  }
+  *where = value;
+}
+/*}}}*/
+static void set_trailed(struct ws *ws, SYMSET *where, SYMSET value)/*{{{*/
+{
+  trail_write(ws, where, value, -1);
+}
+/*}}}*/
+static void set_poss(struct ws *ws, int ic, SYMSET value)/*{{{*/
+{
+  trail_write(ws, &ws->poss[ic], value, ic);
+  if (ws->cells_filed) refile_cell(ws, ic);
+}
+/*}}}*/
+static void set_state(struct ws *ws, int ic, int value)/*{{{*/
+{
+  if (ws->spec_depth > 0) {
+    struct trail_entry *e = add_trail(ws, ic);
+    e->where = NULL;
+    e->old_state = ws->state[ic];
+  }
+  ws->state[ic] = value;
+  if (ws->cells_filed) refile_cell(ws, ic);
+}
+/*}}}*/
+static void undo_trail(struct ws *ws, int mark)/*{{{*/
+{
+  while (ws->n_trail > mark) {
+    struct trail_entry *e = ws->trail + --ws->n_trail;
+    if (e->where) *e->where = e->old;
+    else ws->state[e->cell] = e->old_state;
+    if ((e->cell >= 0) && ws->cells_filed) refile_cell(ws, e->cell);
+  }
+  ws->maps_stale = ws->part_clock;
 }
 /*}}}*/
 static void free_ws(struct ws *ws)/*{{{*/
@@ -277,6 +537,7 @@ static void free_ws(struct ws *ws)/*{{{*/
   struct queue *q;
   free(ws->poss);
   free(ws->todo);
+  free(ws->state);
 
   q = ws->base_q;
   while (q) {
@@ -284,8 +545,14 @@ static void free_ws(struct ws *ws)/*{{{*/
     free_queue(q);
     q = nq;
   }
-  free(ws->group_links);
-  free(ws->cell_links);
+  free_members(&ws->groups);
+  free_members(&ws->cells);
+  free(ws->trail);
+  free_filing(ws);
+  free(ws->group_changed);
+  free(ws->maps_built);
+  free(ws->part_index);
+  free(ws->part_sets);
 
   free(ws);
 }
@@ -293,127 +560,222 @@ static void free_ws(struct ws *ws)/*{{{*/
 
 /* ============================================================================ */
 
-static int inner_infer(struct layout *lay, struct ws *ws);
+static size_t scratch_needed(const struct layout *lay)/*{{{*/
+{
+  /* Enough of the context's scratch arena for any one rule.  (Plus rounding
+   * for alignment.) */
+  return 2 * lay->ns * sizeof(SYMSET) + 16;
+}
+/*}}}*/
+
+/* ============================================================================ */
+
+static int inner_infer(const struct layout *lay, struct ws *ws);
+static void setup_queues(struct ws *ws, const struct constraint *simplify_cons, int options);
+
+/* ============================================================================ */
+
+/* A solver plan is a workspace whose queue chain and links have been built
+ * for one layout, set of rules and options.  The context keeps them, so that
+ * callers that run infer() over and over (grading, reducing) only pay for
+ * setting up the queues once. */
+
+struct solver_plan {/*{{{*/
+  struct solver_plan *next;
+  const struct layout *lay;
+  struct constraint cons;
+  int onlyopt_first;
+  int busy;             /* its workspace is in use by an infer() */
+  struct ws *ws;
+};
+/*}}}*/
+static int same_rules_p(const struct constraint *a, const struct constraint *b)/*{{{*/
+{
+  return ((a->do_lines == b->do_lines) &&
+          (a->do_subsets == b->do_subsets) &&
+          (a->do_onlyopt == b->do_onlyopt) &&
+          (a->max_partition_size == b->max_partition_size));
+}
+/*}}}*/
+static struct solver_plan *get_plan(struct context *ctx, const struct layout *lay,
+    const struct constraint *cons, int options)/*{{{*/
+{
+  struct solver_plan *p;
+  int onlyopt_first = (options & OPT_ONLYOPT_FIRST) ? 1 : 0;
+
+  for (p = PLANS(ctx); p; p = p->next) {
+    if (!p->busy && (p->lay == lay) && (p->onlyopt_first == onlyopt_first) &&
+        same_rules_p(&p->cons, cons)) {
+      /* The queues are left non-empty if the last search stopped early. */
+      clear_queues(lay, p->ws);
+      reset_ws(p->ws);
+      p->busy = 1;
+      return p;
+    }
+  }
+
+  p = new(struct solver_plan);
+  p->lay = lay;
+  p->cons = *cons;
+  p->onlyopt_first = onlyopt_first;
+  p->busy = 1;
+  p->ws = make_ws(lay->nc, lay->ng, lay->ns);
+  setup_queues(p->ws, &p->cons, options);
+  p->next = PLANS(ctx);
+  PLANS(ctx) = p;
+  return p;
+}
+/*}}}*/
+void free_plans(struct solver_plan *plans)/*{{{*/
+{
+  while (plans) {
+    struct solver_plan *next = plans->next;
+    free_ws(plans->ws);
+    free(plans);
+    plans = next;
+  }
+}
+/*}}}*/
 
 /* ============================================================================ */
 
-static void requeue_group(int gi, struct layout *lay, struct ws *ws)/*{{{*/
+static void requeue_group(int gi, const struct layout *lay, struct ws *ws)/*{{{*/
 {
-  struct link *lk = ws->group_links + gi;
-  if (lk->base_q)  {
-    move_to_queue(lk, lk->base_q);
+  struct queue *base_q = lay->is_block[gi] ? ws->base_block_q : ws->base_line_q;
+  ws->group_changed[gi] = ws->part_clock;
+  if (base_q)  {
+    move_to_queue(gi, base_q);
   } else {
     /* No rules are available for this type of resource, ignore. */
   }
 }
 /*}}}*/
-static void requeue_groups(struct layout *lay, struct ws *ws, int ic)/*{{{*/
+static void requeue_groups(const struct layout *lay, struct ws *ws, int ic)/*{{{*/
 {
-  int i;
-  struct cell *cell = lay->cells + ic;
-  for (i=0; i<NDIM; i++) {
-    int gi = cell->group[i];
-    if (gi >= 0) requeue_group(gi, lay, ws);
-    else break;
+  int k;
+  for (k=lay->cell_group_index[ic]; k<lay->cell_group_index[ic+1]; k++) {
+    requeue_group(lay->cell_groups[k], lay, ws);
   }
 }
 /*}}}*/
-static void requeue_cell(int ci, struct layout *lay, struct ws *ws)/*{{{*/
+static void requeue_cell(int ci, const struct layout *lay, struct ws *ws)/*{{{*/
 {
-  if (ws->state[ci] != CELL_BARRED) {
-    move_to_queue(ws->cell_links + ci, ws->base_cell_q);
+  if ((ws->state[ci] != CELL_BARRED) && ws->base_cell_q) {
+    move_to_queue(ci, ws->base_cell_q);
   }
 }
 /*}}}*/
 
-static void allocate(struct layout *lay, struct ws *ws, int is_init, int ic, int val)/*{{{*/
+static void allocate(const struct layout *lay, struct ws *ws, int is_init, int ic, int val)/*{{{*/
 {
-  int mask;
+  SYMSET mask;
   int j, k;
-  int NS;
-  short *base;
-  int other_poss;
+  SYMSET other_poss;
 
-  mask = 1<<val;
-  NS = lay->ns;
+  mask = BIT(val);
 
   if (ws->state[ic] == CELL_MARKED) {
     --ws->n_marked_todo;
   }
-  ws->state[ic] = val;
+  set_state(ws, ic, val);
 
   other_poss = ws->poss[ic] & ~mask;
-  ws->poss[ic] = 0;
+  set_poss(ws, ic, 0);
   if (!is_init && ws->order) {
     ws->order[ic] = (ws->solvepos)++;
   }
 
-  for (k=0; k<NDIM; k++) {
-    int gg = lay->cells[ic].group[k];
-    if (gg >= 0) {
-      ws->todo[gg] &= ~mask;
-      requeue_group(gg, lay, ws);
-      base = lay->groups + gg*NS;
-      for (j=0; j<NS; j++) {
-        int jc;
-        jc = base[j];
-        if (ws->poss[jc] & mask) {
-          ws->poss[jc] &= ~mask;
-          requeue_cell(jc, lay, ws);
-          requeue_groups(lay, ws, jc);
-          if (lay->cells[ic].is_terminal) {
-            lay->cells[ic].is_terminal = 0;
-          }
+  /* The peers listed for each group leave out cells already dealt with for
+   * an earlier group; a second visit would find nothing left to do. */
+  for (k=lay->cell_group_index[ic]; k<lay->cell_group_index[ic+1]; k++) {
+    int gg = lay->cell_groups[k];
+    if (ws->todo[gg] & mask) {
+      set_trailed(ws, &ws->todo[gg], ws->todo[gg] & ~mask);
+    }
+    requeue_group(gg, lay, ws);
+    for (j=lay->peer_index[k]; j<lay->peer_index[k+1]; j++) {
+      int jc;
+      jc = lay->peers[j];
+      if (ws->poss[jc] & mask) {
+        set_poss(ws, jc, ws->poss[jc] & ~mask);
+        requeue_cell(jc, lay, ws);
+        requeue_groups(lay, ws, jc);
+        if (ws->terminal) {
+          ws->terminal[ic] = 0;
         }
-        if (ws->poss[jc] & other_poss) {
-          /* The discovery of state[ic] has contributed to eventually solving [jc],
-           * so [ic] is now non-terminal. */
-          if (lay->cells[ic].is_terminal) {
-            lay->cells[ic].is_terminal = 0;
-          }
+      }
+      if (ws->poss[jc] & other_poss) {
+        /* The discovery of state[ic] has contributed to eventually solving [jc],
+         * so [ic] is now non-terminal. */
+        if (ws->terminal) {
+          ws->terminal[ic] = 0;
         }
       }
-    } else {
-      break;
     }
   }
 }
 /*}}}*/
-static int try_group_allocate(int gi, struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
+/* The group rules below are written in terms of NS, the number of symbols,
+ * passed in as an argument.  Each is built once for any size, and again for
+ * each size in SIZED_WORKERS() with NS a constant, so that the compiler can
+ * unroll the loops over a group; setup_queues() picks the ones for the
+ * layout. */
+#if defined(__GNUC__)
+#define SIZED static inline __attribute__((always_inline))
+#else
+#define SIZED static inline
+#endif
+
+SIZED SYMSET homes_at_most_one(const struct layout *lay, const struct ws *ws, int gi, int NS)/*{{{*/
+{
+  /* The unplaced symbols that have no more than one possible cell left in the
+   * group, found in one pass over the cells: 'once' collects the symbols seen
+   * in any cell so far and 'twice' those seen in two or more. */
+  short *base = lay->groups + gi*NS;
+  SYMSET once = 0, twice = 0;
+  int j;
+  for (j=0; j<NS; j++) {
+    SYMSET p = ws->poss[base[j]];
+    twice |= once & p;
+    once |= p;
+  }
+  return ws->todo[gi] & ~twice;
+}
+/*}}}*/
+SIZED int group_allocate(int gi, const struct layout *lay, struct ws *ws, struct score *score, int NS)/*{{{*/
 {
   /* Return -1 if the solution is broken,
    *        0 if we didn't allocate anything,
    *        1 if we did. */
-  int NS;
   short *base;
-  int sym, mask;
+  int sym;
+  SYMSET mask, hits;
   int found_any = 0;
 
-  NS = lay->ns;
   base = lay->groups + gi*NS;
-  for (sym=0; sym<NS; sym++) {
-    mask = 1<<sym;
-    if (ws->todo[gi] & mask) {
-      int j, count, xic;
+  hits = homes_at_most_one(lay, ws, gi, NS);
+  for (sym=0; hits && (sym<NS); sym++) {
+    mask = BIT(sym);
+    if (hits & mask) {
+      int j, xic;
       xic = -1;
-      count = 0;
       for (j=0; j<NS; j++) {
         int ic = base[j];
         if (ws->poss[ic] & mask) {
           xic = ic;
-          count++;
-          if (count > 1) break;
+          break;
         }
       }
-      if (count == 0) {
+      hits &= ~mask;
+      if (xic < 0) {
         if (!(ws->options & OPT_SPECULATE)) {
           fprintf(stderr, "Cannot allocate <%c> in <%s>\n",
               lay->symbols[sym], lay->group_names[gi]);
         }
         return -1;
-      } else if (count == 1) {
+      } else {
         if (score) {
-          score->foo += 1.0 / (double) count_bits(ws->todo[gi]);
+          score->foo += 1.0 / (double) set_count(ws->todo[gi]);
           found_any = 1;
         } else {
           if (ws->state[xic] != CELL_BARRED) {
@@ -426,10 +788,11 @@ static int try_group_allocate(int gi, struct layout *lay, struct ws *ws, int opt
             allocate(lay, ws, 0, xic, sym);
             if (ws->options & OPT_HINT) {
               free_ws(ws);
-              free_layout(lay);
               exit(0);
             }
             found_any = 1;
+            /* That may have left later symbols with one home or none. */
+            hits = homes_at_most_one(lay, ws, gi, NS) & ~((mask << 1) - 1);
           }
         }
       }
@@ -440,7 +803,7 @@ static int try_group_allocate(int gi, struct layout *lay, struct ws *ws, int opt
 
 }
 /*}}}*/
-static int try_subsets(int gi, struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
+SIZED int subsets(int gi, const struct layout *lay, struct ws *ws, struct score *score, int NS)/*{{{*/
 {
   /* Couldn't do any allocates in the group.
    * So try the more sophisticated analysis:
@@ -449,80 +812,56 @@ static int try_subsets(int gi, struct layout *lay, struct ws *ws, int opt, struc
    * group, we can eliminate the symbol as a possibility from the rest of
    * that other group.
    */
-  int NC, NS, NG;
-  char *flags;
-  int *counts;
   int sym;
-  int n_poss_cells;
   short *base;
+  int start, end;
   int did_anything = 0;
 
-  NS = lay->ns;
-  NC = lay->nc;
-  NG = lay->ng;
-  flags = new_array(char, NC);
-  counts = new_array(int, NG);
-
   base = lay->groups + gi*NS;
+  start = lay->isect_index[gi];
+  end = lay->isect_index[gi+1];
   for (sym=0; sym<NS; sym++) {
-    int mask = (1 << sym);
+    SYMSET mask = BIT(sym);
     if (ws->todo[gi] & mask) {
-      int j;
-      int found_something = 0;
-      memset(flags, 0, NC);
-      memset(counts, 0, NG*sizeof(int));
-      n_poss_cells = 0;
+      int j, n;
+      SYMSET cells = 0;
       for (j=0; j<NS; j++) {
-        int ic = base[j];
-        if (ws->poss[ic] & mask) {
-          int m;
-          ++n_poss_cells;
-          flags[ic] = 1;
-          for (m=0; m<NDIM; m++) {
-            int gm = lay->cells[ic].group[m];
-            if (gm >= 0) {
-              if (gm != gi) ++counts[gm];
-            } else {
-              break;
-            }
-          }
-        }
+        if (ws->poss[base[j]] & mask) cells |= BIT(j);
       }
-      for (j=0; j<NG; j++) {
-        if (counts[j] == n_poss_cells) {
+      /* No home at all : try_group_allocate() reports that. */
+      if (!cells) continue;
+      for (n=start; n<end; n++) {
+        if (!(cells & ~lay->isect_mask[n])) {
+          int gj = lay->isect_group[n];
+          SYMSET rest = ~lay->isect_other[n];
+          short *obase = lay->groups + gj*NS;
           int m;
-          short *base = lay->groups + j*NS;
           for (m=0; m<NS; m++) {
-            int ic = base[m];
-            if (!flags[ic]) { /* cell not in the original group. */
-              if (ws->poss[ic] & mask) {
-                if (score) {
-                } else {
-                  if (ws->options & OPT_VERBOSE) {
-                    fprintf(stderr, "(s) Removing <%c> from <%s> (in <%s> due to placement in <%s>)\n",
-                        lay->symbols[sym], lay->cells[ic].name,
-                        lay->group_names[j], lay->group_names[gi]);
-                  }
-                  ws->poss[ic] &= ~mask;
-                  requeue_cell(ic, lay, ws);
-                  requeue_groups(lay, ws, ic);
-                  found_something = 1;
+            int ic = obase[m];
+            if ((rest & BIT(m)) && (ws->poss[ic] & mask)) {
+              if (score) {
+              } else {
+                if (ws->options & OPT_VERBOSE) {
+                  fprintf(stderr, "(s) Removing <%c> from <%s> (in <%s> due to placement in <%s>)\n",
+                      lay->symbols[sym], lay->cells[ic].name,
+                      lay->group_names[gj], lay->group_names[gi]);
                 }
-                did_anything = 1;
+                set_poss(ws, ic, ws->poss[ic] & ~mask);
+                requeue_cell(ic, lay, ws);
+                requeue_groups(lay, ws, ic);
               }
+              did_anything = 1;
             }
           }
         }
       }
     }
   }
-  free(counts);
-  free(flags);
   return did_anything ? 1 : 0;
 }
 /*}}}*/
 
-static int do_ext_remove(int gi, struct layout *lay, struct ws *ws, int n, int symbol_set, int matching_cells)/*{{{*/
+static int do_ext_remove(int gi, const struct layout *lay, struct ws *ws, int n, SYMSET symbol_set, SYMSET matching_cells)/*{{{*/
 {
   int i;
   int NS = lay->ns;
@@ -536,7 +875,7 @@ static int do_ext_remove(int gi, struct layout *lay, struct ws *ws, int n, int s
   for (i=0; i<NS; i++) {
     int ic = base[i];
     fprintf(stderr, "  %c %s : ",
-        ((1<<i) & matching_cells) ? '*' : ' ',
+        (BIT(i) & matching_cells) ? '*' : ' ',
         lay->cells[ic].name);
     show_symbols_in_set(NS, lay->symbols, ws->poss[ic]);
     fprintf(stderr, "\n");
@@ -545,8 +884,7 @@ static int do_ext_remove(int gi, struct layout *lay, struct ws *ws, int n, int s
   
   for (i=0; i<NS; i++) {
     int ic = base[i];
-    int mask = (1 << i);
-    if (mask & matching_cells) continue;
+    if (BIT(i) & matching_cells) continue;
     if (ws->poss[ic] & symbol_set) {
       did_anything = 1;
       if (ws->options & OPT_VERBOSE) {
@@ -560,7 +898,7 @@ static int do_ext_remove(int gi, struct layout *lay, struct ws *ws, int n, int s
         fprintf(stderr, "> must be in <");
         fk = 1;
         for (k=0; k<NS; k++) {
-          if (matching_cells & (1<<k)) {
+          if (matching_cells & BIT(k)) {
             int ck = base[k];
             if (!fk) {
               fprintf(stderr, ",");
@@ -573,7 +911,7 @@ static int do_ext_remove(int gi, struct layout *lay, struct ws *ws, int n, int s
         }
         fprintf(stderr, "> in <%s>\n", lay->group_names[gi]);
       }
-      ws->poss[ic] &= ~symbol_set;
+      set_poss(ws, ic, ws->poss[ic] & ~symbol_set);
       requeue_cell(ic, lay, ws);
       requeue_groups(lay, ws, ic);
     }
@@ -581,7 +919,7 @@ static int do_ext_remove(int gi, struct layout *lay, struct ws *ws, int n, int s
   return did_anything;
 }
 /*}}}*/
-static int do_int_remove(int gi, struct layout *lay, struct ws *ws, int n, int cell_set, int matching_symbols)/*{{{*/
+static int do_int_remove(int gi, const struct layout *lay, struct ws *ws, int n, SYMSET cell_set, SYMSET matching_symbols)/*{{{*/
 {
   int i;
   int NS = lay->ns;
@@ -596,14 +934,14 @@ static int do_int_remove(int gi, struct layout *lay, struct ws *ws, int n, int c
   for (i=0; i<NS; i++) {
     int ic = base[i];
     fprintf(stderr, "  %c %s : ",
-        ((1<<i) & cell_set) ? '*' : ' ',
+        (BIT(i) & cell_set) ? '*' : ' ',
         lay->cells[ic].name);
     show_symbols_in_set(NS, lay->symbols, ws->poss[ic]);
     fprintf(stderr, "\n");
   }
 #endif
   for (i=0; i<NS; i++) {
-    if (cell_set & (1<<i)) {
+    if (cell_set & BIT(i)) {
       int ic = base[i];
       if (ws->poss[ic] & ~matching_symbols) {
         if (ws->options & OPT_VERBOSE) {
@@ -614,7 +952,7 @@ static int do_int_remove(int gi, struct layout *lay, struct ws *ws, int n, int c
           fprintf(stderr, "> in <%s>\n", lay->group_names[gi]);
         }
         did_anything = 1;
-        ws->poss[ic] &= matching_symbols;
+        set_poss(ws, ic, ws->poss[ic] & matching_symbols);
         requeue_cell(ic, lay, ws);
         requeue_groups(lay, ws, ic);
       }
@@ -623,30 +961,74 @@ static int do_int_remove(int gi, struct layout *lay, struct ws *ws, int n, int c
   return did_anything;
 }
 /*}}}*/
-static int try_partition(int gi, struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
+struct partition {/*{{{*/
+  const struct layout *lay;
+  struct ws *ws;
+  int gi;
+  int k;                /* size of the subsets being looked for */
+  int *cmap;            /* [NN] position in the group of each open cell */
+  int *smap;            /* [NN] each symbol still to place */
+  SYMSET *fposs;        /* [NN] which symbols each open cell could take */
+  SYMSET *rposs;        /* [NN] which positions each symbol could go in */
+};
+/*}}}*/
+#define PART_EXT 1
+#define PART_INT 2
+static int search_partition(struct partition *p, int depth, int top, SYMSET fu, SYMSET ru, SYMSET cells, SYMSET syms, int live)/*{{{*/
 {
-  int N, NN;
-  int cmap[64], icmap[64];
-  int smap[64], ismap[64];
-  int fposs[64], rposs[64];
-  int i, j, k;
+  /* Pick the next member of the subset from below 'top'.  The subsets come
+   * out in the same order as from nested loops, highest index outermost.
+   * Adding members can only make the unions bigger, so a side that already
+   * has more than k bits is dropped, and the whole branch once both are. */
+  int k = p->k;
+  int a;
+  for (a = k - 1 - depth; a < top; a++) {
+    SYMSET f = fu | p->fposs[a];
+    SYMSET r = ru | p->rposs[a];
+    SYMSET c = cells | BIT(p->cmap[a]);
+    SYMSET s = syms | BIT(p->smap[a]);
+    if (depth + 1 == k) {
+      if ((live & PART_EXT) && (set_count(f) == k)) {
+        if (do_ext_remove(p->gi, p->lay, p->ws, k, f, c))
+          return 1;
+      }
+      if ((live & PART_INT) && (set_count(r) == k)) {
+        /* Hit : interior split */
+        if (do_int_remove(p->gi, p->lay, p->ws, k, r, s))
+          return 1;
+      }
+    } else {
+      int now_live = live;
+      if ((live & PART_EXT) && (set_count(f) > k)) now_live &= ~PART_EXT;
+      if ((live & PART_INT) && (set_count(r) > k)) now_live &= ~PART_INT;
+      if (now_live) {
+        if (search_partition(p, depth + 1, a, f, r, c, s, now_live))
+          return 1;
+      }
+    }
+  }
+  return 0;
+}
+/*}}}*/
+SIZED void build_partition_maps(int gi, const struct layout *lay, struct ws *ws, struct partition *p, int NS)/*{{{*/
+{
+  int i, j, NN;
+  int *ismap;
+  size_t mark;
   short *base;
-  
-  NN = N = count_bits(ws->todo[gi]);
-  N = (N+1) >> 1;
-  /* If we're being told to look for partitions bigger than 1/2 the number of
-   * entries left, we're wasting our time. */
-  if (opt > N) return 0;
 
-  base = lay->groups + (gi * lay->ns);
-  memset(rposs, 0, sizeof(int) * lay->ns);
+  NN = set_count(ws->todo[gi]);
+  base = lay->groups + (gi * NS);
+  mark = ws->ctx->scratch.used;
+  ismap = arena_alloc(&ws->ctx->scratch, NS * sizeof(int));
+
   /* Loop over symbols */
   j = 0;
-  for (i=0; i<lay->ns; i++) {
-    int mask = 1<<i;
-    if (mask & ws->todo[gi]) {
-      smap[j] = i;
+  for (i=0; i<NS; i++) {
+    if (BIT(i) & ws->todo[gi]) {
+      p->smap[j] = i;
       ismap[i] = j;
+      p->rposs[j] = 0;
       j++;
     }
   }
@@ -656,19 +1038,15 @@ static int try_partition(int gi, struct layout *lay, struct ws *ws, int opt, str
   }
   /* Loop over cells */
   j = 0;
-  for (i=0; i<lay->ns; i++) {
+  for (i=0; i<NS; i++) {
     int ic = base[i];
     if (ws->state[ic] < 0) {
-      cmap[j] = i;
-      icmap[i] = j;
-      fposs[j] = ws->poss[ic];
-      for (k=0; k<lay->ns; k++) {
-        int mask = 1<<k;
-        int kk = ismap[k];
-        if (mask & ws->poss[ic]) {
-          /* Build map of which cells can take which symbols. */
-          rposs[kk] |= (1<<i);
-        }
+      SYMSET left;
+      p->cmap[j] = i;
+      p->fposs[j] = ws->poss[ic];
+      /* Build map of which cells can take which symbols. */
+      for (left = ws->poss[ic]; left; left &= left - 1) {
+        p->rposs[ismap[set_first(left)]] |= BIT(i);
       }
       j++;
     }
@@ -677,143 +1055,98 @@ static int try_partition(int gi, struct layout *lay, struct ws *ws, int opt, str
     fprintf(stderr, "j != NN at %d\n", __LINE__);
     exit(1);
   }
-
-  switch (opt) {
-    case 2:/*{{{*/
-      {
-        int a0, a1;
-        for (a0 = 1; a0 < NN; a0++) {
-          for (a1 = 0; a1 < a0; a1++) {
-            int U;
-            U = fposs[a0] | fposs[a1];
-            if (count_bits(U) == 2) {
-              if (!score) {
-                int matching_cells = (1 << cmap[a0]) | (1 << cmap[a1]);
-                if (do_ext_remove(gi, lay, ws, 2, U, matching_cells)) 
-                  return 1;
-              }
-            }
-            U = rposs[a0] | rposs[a1];
-            if (count_bits(U) == 2) {
-              if (!score) {
-                int matching_symbols = (1 << smap[a0]) | (1 << smap[a1]);
-                /* Hit : interior split */
-                if (do_int_remove(gi, lay, ws, 2, U, matching_symbols)) 
-                  return 1;
-              }
-            }
-          }
-        }
-      } 
-      break;
-/*}}}*/
-    case 3:/*{{{*/
-      {
-        int a0, a1, a2;
-        for (a0 = 2; a0 < NN; a0++) {
-          for (a1 = 1; a1 < a0; a1++) {
-            for (a2 = 0; a2 < a1; a2++) {
-              int U;
-              U = fposs[a0] | fposs[a1] | fposs[a2];
-              if (count_bits(U) == 3) {
-                if (!score) {
-                  int matching_cells = (1 << cmap[a0]) | (1 << cmap[a1]) | (1 << cmap[a2]);
-                  if (do_ext_remove(gi, lay, ws, 3, U, matching_cells)) 
-                    return 1;
-                }
-              }
-              U = rposs[a0] | rposs[a1] | rposs[a2];
-              if (count_bits(U) == 3) {
-                if (!score) {
-                  int matching_symbols = (1 << smap[a0]) | (1 << smap[a1]) | (1 << smap[a2]);
-                  /* Hit : interior split */
-                  if (do_int_remove(gi, lay, ws, 3, U, matching_symbols))
-                    return 1;
-                }
-              }
-            }
-          }
-        }
-      } 
-      break;
-/*}}}*/
-    case 4:/*{{{*/
-      {
-        int a0, a1, a2, a3;
-        for (a0 = 3; a0 < NN; a0++) {
-          for (a1 = 2; a1 < a0; a1++) {
-            for (a2 = 1; a2 < a1; a2++) {
-              for (a3 = 0; a3 < a2; a3++) {
-                int U;
-                U = fposs[a0] | fposs[a1] | fposs[a2] | fposs[a3];
-                if (count_bits(U) == 4) {
-                  if (!score) {
-                    int matching_cells = (1 << cmap[a0]) | (1 << cmap[a1]) | (1 << cmap[a2]) | (1 << cmap[a3]);
-                    if (do_ext_remove(gi, lay, ws, 4, U, matching_cells)) 
-                      return 1;
-                  }
-                }
-                U = rposs[a0] | rposs[a1] | rposs[a2] | rposs[a3];
-                if (count_bits(U) == 4) {
-                  if (!score) {
-                    int matching_symbols = (1 << smap[a0]) | (1 << smap[a1]) | (1 << smap[a2]) | (1 << smap[a3]);
-                    /* Hit : interior split */
-                    if (do_int_remove(gi, lay, ws, 4, U, matching_symbols)) {
-                      return 1;
-                    }
-                  }
-                }
-              }
-            }
-          }
-        }
-      } 
-      break;
-/*}}}*/
-    case 5:/*{{{*/
-      {
-        int a0, a1, a2, a3, a4;
-        for (a0 = 4; a0 < NN; a0++) {
-          for (a1 = 3; a1 < a0; a1++) {
-            for (a2 = 2; a2 < a1; a2++) {
-              for (a3 = 1; a3 < a2; a3++) {
-                for (a4 = 0; a4 < a3; a4++) {
-                  int U;
-                  U = fposs[a0] | fposs[a1] | fposs[a2] | fposs[a3] | fposs[a4];
-                  if (count_bits(U) == 5) {
-                    if (!score) {
-                      int matching_cells = (1 << cmap[a0]) | (1 << cmap[a1]) | (1 << cmap[a2]) | (1 << cmap[a3]) | (1 << cmap[a4]);
-                      if (do_ext_remove(gi, lay, ws, 5, U, matching_cells)) 
-                        return 1;
-                    }
-                  }
-                  U = rposs[a0] | rposs[a1] | rposs[a2] | rposs[a3] | rposs[a4];
-                  if (count_bits(U) == 5) {
-                    if (!score) {
-                      int matching_symbols = (1 << smap[a0]) | (1 << smap[a1]) | (1 << smap[a2]) | (1 << smap[a3]) | (1 << smap[a4]);
-                      /* Hit : interior split */
-                      if (do_int_remove(gi, lay, ws, 5, U, matching_symbols)) {
-                        return 1;
-                      }
-                    }
-                  }
-                }
-              }
-            }
-          }
-        }
-      } 
-      break;
+  ws->ctx->scratch.used = mark;
+  ws->maps_built[gi] = ++ws->part_clock;
+}
 /*}}}*/
-    default:
-      /* Until we get the capability to do bigger partitions... */
-      return 0;
+SIZED int partition(int gi, const struct layout *lay, struct ws *ws, int opt, struct score *score, int NS)/*{{{*/
+{
+  /* Look for 'opt' open cells in the group that can only hold 'opt' symbols
+   * between them, or 'opt' symbols that can only go in 'opt' cells. */
+  struct partition p;
+  int N, NN;
+
+  /* Nothing is scored for partitions. */
+  if (score) return 0;
+
+  NN = N = set_count(ws->todo[gi]);
+  N = (N+1) >> 1;
+  /* If we're being told to look for partitions bigger than 1/2 the number of
+   * entries left, we're wasting our time. */
+  if (opt > N) return 0;
+
+  p.lay = lay;
+  p.ws = ws;
+  p.gi = gi;
+  p.k = opt;
+  p.cmap = ws->part_index + gi * 2 * NS;
+  p.smap = p.cmap + NS;
+  p.fposs = ws->part_sets + gi * 2 * NS;
+  p.rposs = p.fposs + NS;
+  if ((ws->maps_built[gi] <= ws->group_changed[gi]) ||
+      (ws->maps_built[gi] <= ws->maps_stale)) {
+    build_partition_maps(gi, lay, ws, &p, NS);
   }
-  return 0;
+
+  return search_partition(&p, 0, NN, 0, 0, 0, 0, PART_EXT | PART_INT);
+}
+/*}}}*/
+static int try_group_allocate(int gi, const struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
+{
+  return group_allocate(gi, lay, ws, score, lay->ns);
+}
+/*}}}*/
+static int try_subsets(int gi, const struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
+{
+  return subsets(gi, lay, ws, score, lay->ns);
+}
+/*}}}*/
+static int try_partition(int gi, const struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
+{
+  return partition(gi, lay, ws, opt, score, lay->ns);
 }
 /*}}}*/
 
-static int try_split_internal(int gi, struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
+struct group_workers {/*{{{*/
+  int ns;               /* the size they are for, 0 for any */
+  WORKER group_allocate;
+  WORKER subsets;
+  WORKER partition;
+};
+/*}}}*/
+#define SIZED_WORKERS(n) \
+  static int try_group_allocate_##n(int gi, const struct layout *lay, struct ws *ws, int opt, struct score *score) \
+  { return group_allocate(gi, lay, ws, score, n); } \
+  static int try_subsets_##n(int gi, const struct layout *lay, struct ws *ws, int opt, struct score *score) \
+  { return subsets(gi, lay, ws, score, n); } \
+  static int try_partition_##n(int gi, const struct layout *lay, struct ws *ws, int opt, struct score *score) \
+  { return partition(gi, lay, ws, opt, score, n); }
+#define SIZED_ENTRY(n) { n, try_group_allocate_##n, try_subsets_##n, try_partition_##n }
+
+/* The common sizes: 2x2, 2x3, 3x3, 4x4 and 5x5 blocks. */
+#if defined(NARROW_SETS)
+SIZED_WORKERS(4)
+SIZED_WORKERS(6)
+SIZED_WORKERS(9)
+SIZED_WORKERS(16)
+#elif !defined(WIDE_SETS)
+SIZED_WORKERS(25)
+#endif
+
+static const struct group_workers group_workers[] = {/*{{{*/
+#if defined(NARROW_SETS)
+  SIZED_ENTRY(4),
+  SIZED_ENTRY(6),
+  SIZED_ENTRY(9),
+  SIZED_ENTRY(16),
+#elif !defined(WIDE_SETS)
+  SIZED_ENTRY(25),
+#endif
+  { 0, try_group_allocate, try_subsets, try_partition }
+};
+/*}}}*/
+
+static int try_split_internal(int gi, const struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
 {
   /* 
    * Deal with this case: suppose the symbols 2,3,5,6 are unallocated within
@@ -825,42 +1158,42 @@ static int try_split_internal(int gi, struct layout *lay, struct ws *ws, int opt
    * as a possibility on B.
    * */
 
-  int NC, NS, NG;
+  int NS;
   int did_anything = 0;
-  int *intersect, *poss_map;
+  SYMSET *intersect, *poss_map;
+  size_t mark;
   int sym, cell, ci;
-  int fill, mask;
+  SYMSET fill, mask;
   short *base;
 
   NS = lay->ns;
-  NC = lay->nc;
-  NG = lay->ng;
-  intersect = new_array(int, NS);
-  poss_map = new_array(int, NS);
+  mark = ws->ctx->scratch.used;
+  intersect = arena_alloc(&ws->ctx->scratch, NS * sizeof(SYMSET));
+  poss_map = arena_alloc(&ws->ctx->scratch, NS * sizeof(SYMSET));
 
   base = lay->groups + gi*NS;
-  fill = (1 << NS) - 1;
+  fill = FILL(NS);
   
   for (sym=0; sym<NS; sym++) {
     intersect[sym] = fill;
     poss_map[sym] = 0;
-    mask = 1<<sym;
+    mask = BIT(sym);
     for (cell=0; cell<NS; cell++) {
       ci = base[cell];
       if (ws->poss[ci] & mask) {
         intersect[sym] &= ws->poss[ci];
-        poss_map[sym] |= (1<<cell);
+        poss_map[sym] |= BIT(cell);
       }
     }
   }
 
   /* Now analyse to look for candidates. */
   for (sym=0; sym<NS; sym++) {
-    if (count_bits(intersect[sym]) == count_bits(poss_map[sym])) {
+    if (set_count(intersect[sym]) == set_count(poss_map[sym])) {
       /* that is a necessary condition... */
       int sym1;
       for (sym1=0; sym1<NS; sym1++) {
-        int mask = 1<<sym1;
+        SYMSET mask = BIT(sym1);
         if (sym1 == sym) continue;
         if (intersect[sym] & mask) {
           if ((intersect[sym] == intersect[sym1]) &&
@@ -874,7 +1207,7 @@ static int try_split_internal(int gi, struct layout *lay, struct ws *ws, int opt
 
       /* Good subset: */
       for (cell=0; cell<NS; cell++) {
-        if (poss_map[sym] & (1<<cell)) {
+        if (poss_map[sym] & BIT(cell)) {
           int ci = base[cell];
           if (ws->poss[ci] != intersect[sym]) {
             if (score) {
@@ -886,7 +1219,7 @@ static int try_split_internal(int gi, struct layout *lay, struct ws *ws, int opt
                 show_symbols_in_set(NS, lay->symbols, intersect[sym]);
                 fprintf(stderr, "> in <%s>\n", lay->group_names[gi]);
               }
-              ws->poss[ci] = intersect[sym];
+              set_poss(ws, ci, intersect[sym]);
               requeue_cell(ci, lay, ws);
               requeue_groups(lay, ws, ci);
             }
@@ -899,18 +1232,17 @@ examine_next_symbol:
     (void) 0;
   }
 
-  free(intersect);
-  free(poss_map);
+  ws->ctx->scratch.used = mark;
   return did_anything ? 1 : 0;
 }
 /*}}}*/
-static int subset_or_eq_p(int x, int y)/*{{{*/
+static int subset_or_eq_p(SYMSET x, SYMSET y)/*{{{*/
 {
   if (x & ~y) return 0;
   else return 1;
 }
 /*}}}*/
-static int try_split_external(int gi, struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
+static int try_split_external(int gi, const struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
 {
   /* 
    * Deal with this case: suppose the symbols 2,3,5 are unallocated within
@@ -922,19 +1254,19 @@ static int try_split_external(int gi, struct layout *lay, struct ws *ws, int opt
    * analysis.  Then we can eliminate 3 as an option on C.
    * */
 
-  int NC, NS, NG;
+  int NS;
   int did_anything = 0;
   int did_anything_this_iter;
   int i, ci, j, cj;
   short *base;
   char *flags;
+  size_t mark;
 
   NS = lay->ns;
-  NC = lay->nc;
-  NG = lay->ng;
 
   base = lay->groups + gi*NS;
-  flags = new_array(char, NS);
+  mark = ws->ctx->scratch.used;
+  flags = arena_alloc(&ws->ctx->scratch, NS);
 
   do {
     did_anything_this_iter = 0;
@@ -960,7 +1292,7 @@ static int try_split_external(int gi, struct layout *lay, struct ws *ws, int opt
         }
       }
       /* count==1 is a normal allocate done elsewhere! */
-      if ((count > 1) && (other_count > 1) && (count == count_bits(ws->poss[ci]))) {
+      if ((count > 1) && (other_count > 1) && (count == set_count(ws->poss[ci]))) {
         /* got one. */
         for (j=0; j<NS; j++) {
           cj = base[j];
@@ -993,7 +1325,7 @@ static int try_split_external(int gi, struct layout *lay, struct ws *ws, int opt
                 }
                 fprintf(stderr, "> in <%s>\n", lay->group_names[gi]);
               }
-              ws->poss[cj] &= ~ws->poss[ci];
+              set_poss(ws, cj, ws->poss[cj] & ~ws->poss[ci]);
               requeue_cell(cj, lay, ws);
               requeue_groups(lay, ws, cj);
             }
@@ -1003,18 +1335,16 @@ static int try_split_external(int gi, struct layout *lay, struct ws *ws, int opt
     }
   } while (did_anything_this_iter);
 
-  free(flags);
+  ws->ctx->scratch.used = mark;
   return did_anything ? 1 : 0;
 }
 /*}}}*/
 
-static int try_onlyopt(int ic, struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
+static int try_onlyopt(int ic, const struct layout *lay, struct ws *ws, int opt, struct score *score)/*{{{*/
 {
-  int NC;
   int nb;
-  NC = lay->nc;
   if (ws->state[ic] < 0) {
-    nb = count_bits(ws->poss[ic]);
+    nb = set_count(ws->poss[ic]);
     if (nb == 0) {
       if (!(ws->options & OPT_SPECULATE)) {
         fprintf(stderr, "Cell <%s> has no options left\n", lay->cells[ic].name);
@@ -1023,7 +1353,7 @@ static int try_onlyopt(int ic, struct layout *lay, struct ws *ws, int opt, struc
     } else if (nb == 1) {
       if (score) {
       } else {
-        int sym = decode(ws->poss[ic]);
+        int sym = set_first(ws->poss[ic]);
         if (ws->options & OPT_VERBOSE) {
           fprintf(stderr, "(o) Allocate <%c> to <%s> (only option)\n",
               lay->symbols[sym], lay->cells[ic].name);
@@ -1032,7 +1362,6 @@ static int try_onlyopt(int ic, struct layout *lay, struct ws *ws, int opt, struc
         allocate(lay, ws, 0, ic, sym);
         if (ws->options & OPT_HINT) {
           free_ws(ws);
-          free_layout(lay);
           exit(0);
         }
       }
@@ -1043,42 +1372,250 @@ static int try_onlyopt(int ic, struct layout *lay, struct ws *ws, int opt, struc
 }
 /*}}}*/
 
-static int select_minimal_cell(struct layout *lay, int *state, int *poss, int in_overlap)/*{{{*/
+static int first_filed(const struct ws *ws, int count, const unsigned long *among)/*{{{*/
+{
+  const unsigned long *bits = ws->filed + count*ws->n_words;
+  int w;
+  for (w=0; w<ws->n_words; w++) {
+    unsigned long x = among ? (bits[w] & among[w]) : bits[w];
+    if (x) return w*WORD_BITS + __builtin_ctzl(x);
+  }
+  return -1;
+}
+/*}}}*/
+static int select_minimal_cell(const struct layout *lay, struct ws *ws, int in_overlap)/*{{{*/
 {
+  /* The open cell with the fewest candidates (the first, if there's a tie),
+   * from the overlap cells only if in_overlap. */
   int ic;
   int minbits;
   int i;
+  if (lay->nc >= FILE_CELLS_MIN) {
+    if (!ws->cells_filed) file_cells(lay, ws);
+    for (i=0; i<=lay->ns; i++) {
+      if (in_overlap) {
+        if (ws->n_filed_overlap[i]) return first_filed(ws, i, ws->overlap);
+      } else {
+        if (ws->n_filed[i]) return first_filed(ws, i, NULL);
+      }
+    }
+    return -1;
+  }
+  if (!in_overlap) {
+    return fewest_candidates(ws->poss, ws->state, lay->nc);
+  }
   minbits = lay->ns + 1;
   ic = -1;
-  for (i=0; i<lay->nc; i++) {
-    if (!in_overlap || lay->cells[i].is_overlap) {
-      if (state[i] < 0) {
-        int nb = count_bits(poss[i]);
-        if (nb < minbits) {
-          minbits = nb;
-          ic = i;
-        }
+  for (i=0; i<lay->n_overlap; i++) {
+    int jc = lay->overlap_cells[i];
+    if (ws->state[jc] < 0) {
+      int nb = set_count(ws->poss[jc]);
+      if (nb < minbits) {
+        minbits = nb;
+        ic = jc;
       }
     }
   }
   return ic;
 }
 /*}}}*/
-static int speculate(struct layout *lay, struct ws *ws_in)/*{{{*/
+
+/* ============================================================================ */
+
+/* Parallel speculation.  Near the top of the search tree, each guess for the
+ * chosen cell becomes a task on the context's thread pool, solving a detached
+ * copy of the workspace (with its own queues and grid).  Deeper down, the
+ * branches are searched sequentially inside the task, as before. */
+
+/* Guesses at depths below this become pool tasks. */
+#define SPEC_TASK_DEPTH 4
+
+struct spec_frame {/*{{{*/
+  struct spec_frame *parent;
+  int parent_branch;    /* which of the parent's branches this is inside */
+  int total_n_sol;      /* updated atomically by the branches */
+  int cutoff;           /* the branches after this one can't change the
+                           outcome any more (lowered atomically) */
+};
+/*}}}*/
+struct spec_branch {/*{{{*/
+  const struct layout *lay;
+  struct ws *ws;
+  struct context ctx;
+  int index;            /* in the order the sequential search would try them */
+  int ic, val;
+  int n_sol;
+};
+/*}}}*/
+
+static int spec_cancelled(const struct ws *ws)/*{{{*/
+{
+  /* Whether the caller has lost interest in the result of this search, either
+   * because an earlier sibling branch (here or further up) has settled it or
+   * because the whole infer() has been abandoned. */
+  const struct spec_frame *frame = ws->frame;
+  int branch = ws->branch;
+  if (ws->ctx->abandon && __atomic_load_n(ws->ctx->abandon, __ATOMIC_RELAXED)) return 1;
+  while (frame) {
+    if (branch > __atomic_load_n(&frame->cutoff, __ATOMIC_RELAXED)) return 1;
+    branch = frame->parent_branch;
+    frame = frame->parent;
+  }
+  return 0;
+}
+/*}}}*/
+static void lower_cutoff(struct spec_frame *frame, int branch)/*{{{*/
+{
+  int old = __atomic_load_n(&frame->cutoff, __ATOMIC_RELAXED);
+  while ((branch < old) &&
+         !__atomic_compare_exchange_n(&frame->cutoff, &old, branch, 0,
+           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+/*}}}*/
+static struct ws *detach_ws(const struct layout *lay, const struct ws *src)/*{{{*/
+{
+  /* Like clone_ws(), but with private queues and a private copy of the grid,
+   * so that the clone can be solved on another thread. */
+  struct ws *ws;
+  ws = clone_ws(src);
+  make_members(ws);
+  setup_queues(ws, ws->cons, ws->options);
+  ws->state = copy_states(src->nc, src->state);
+  return ws;
+}
+/*}}}*/
+static void run_spec_branch(void *arg)/*{{{*/
+{
+  struct spec_branch *b = (struct spec_branch *) arg;
+  struct ws *ws = b->ws;
+  struct spec_frame *frame = ws->frame;
+  int total;
+
+  b->n_sol = 0;
+  if (spec_cancelled(ws)) return;
+
+  ws->ctx = &b->ctx;
+  --ws->n_todo;
+  allocate(b->lay, ws, 0, b->ic, b->val);
+  b->n_sol = inner_infer(b->lay, ws);
+  if (b->n_sol > 0) {
+    total = __atomic_add_fetch(&frame->total_n_sol, b->n_sol, __ATOMIC_ACQ_REL);
+    if (ws->options & OPT_FIRST_ONLY) {
+      /* Only an earlier branch could still provide the solution kept. */
+      lower_cutoff(frame, b->index);
+    } else if ((ws->options & OPT_STOP_ON_2) && (total >= 2)) {
+      /* Nothing can change the answer any more. */
+      lower_cutoff(frame, -1);
+    }
+  }
+}
+/*}}}*/
+static int parallel_speculate_p(const struct ws *ws)/*{{{*/
+{
+  if (!ws->ctx->pool) return 0;
+  if (pool_size(ws->ctx->pool) < 2) return 0;
+  if (ws->spec_depth >= SPEC_TASK_DEPTH) return 0;
+  /* Things which depend on the branches being searched one at a time, in
+   * order. */
+  if (ws->order || ws->terminal) return 0;
+  if (ws->options & (OPT_SHOW_ALL | OPT_SCORE | OPT_HINT | OPT_VERBOSE)) return 0;
+  return 1;
+}
+/*}}}*/
+static int parallel_speculate(const struct layout *lay, struct ws *ws_in, int ic, int start_point)/*{{{*/
+{
+  struct spec_frame frame;
+  struct spec_branch *branches;
+  struct task_group group;
+  int n_branches;
+  int i, chosen;
+  int total_n_sol;
+  int NS = lay->ns;
+
+  frame.parent = ws_in->frame;
+  frame.parent_branch = ws_in->branch;
+  frame.total_n_sol = 0;
+  frame.cutoff = NS;
+  branches = new_array(struct spec_branch, NS);
+  n_branches = 0;
+  group.pending = 0;
+
+  for (i=0; i<NS; i++) {
+    int ii = (i + start_point) % NS;
+    if (BIT(ii) & ws_in->poss[ic]) {
+      struct spec_branch *b = branches + n_branches++;
+      b->lay = lay;
+      b->index = n_branches - 1;
+      b->ic = ic;
+      b->val = ii;
+      /* Seed each branch from the parent's stream, in order, so the search
+       * doesn't depend on which thread picks up which branch. */
+      init_context(&b->ctx, ctx_random(ws_in->ctx));
+      arena_reserve(&b->ctx.scratch, scratch_needed(lay));
+      b->ctx.out = ws_in->ctx->out;
+      b->ctx.pool = ws_in->ctx->pool;
+      b->ctx.abandon = ws_in->ctx->abandon;
+      b->ws = detach_ws(lay, ws_in);
+      b->ws->frame = &frame;
+      b->ws->branch = b->index;
+    }
+  }
+  for (i=0; i<n_branches; i++) {
+    pool_submit(ws_in->ctx->pool, &group, run_spec_branch, branches + i);
+  }
+  pool_wait(ws_in->ctx->pool, &group);
+
+  /* Combine the results the same way the sequential search would: the
+   * solution kept is from the last branch that had one, or with -f the first
+   * one, and then nothing after it counts.  Only branches after one with a
+   * solution get cut short, so the earlier ones have all run to the end and
+   * the choice doesn't depend on timing. */
+  total_n_sol = 0;
+  chosen = -1;
+  for (i=0; i<n_branches; i++) {
+    struct spec_branch *b = branches + i;
+    if (b->n_sol > 0) {
+      total_n_sol += b->n_sol;
+      chosen = i;
+      if (ws_in->options & OPT_FIRST_ONLY) break;
+    }
+  }
+  if ((ws_in->options & OPT_FIRST_ONLY) && (total_n_sol > 1)) {
+    total_n_sol = 1;
+  }
+  if (chosen >= 0) {
+    memcpy(ws_in->state, branches[chosen].ws->state, lay->nc);
+    ws_in->cells_filed = 0;
+    ws_in->maps_stale = ws_in->part_clock;
+  }
+  for (i=0; i<n_branches; i++) {
+    free_ws(branches[i].ws);
+    free_context(&branches[i].ctx);
+  }
+  free(branches);
+  return total_n_sol;
+}
+/*}}}*/
+static int speculate(const struct layout *lay, struct ws *ws)/*{{{*/
 {
   /* Called when all else fails and we have to guess a cell but be able to back
-   * out the guess if it goes wrong. */
+   * out the guess if it goes wrong.  Each guess is made in place; the trail
+   * records what it changed, so it can be undone before trying the next. */
   int ic;
   int start_point;
   int i;
   int NS, NC;
-  int *scratch, *solution;
+  signed char *solution;
   int n_sol, total_n_sol;
   int n_poss;
+  int mark, kept;
+  int n_todo, n_marked_todo, solvepos;
+  double score;
 
-  ic = select_minimal_cell(lay, ws_in->state, ws_in->poss, 1);
+  ic = select_minimal_cell(lay, ws, 1);
   if (ic < 0) {
-    ic = select_minimal_cell(lay, ws_in->state, ws_in->poss, 0);
+    ic = select_minimal_cell(lay, ws, 0);
   }
   if (ic < 0) {
     return 0;
@@ -1086,48 +1623,75 @@ static int speculate(struct layout *lay, struct ws *ws_in)/*{{{*/
 
   NS = lay->ns;
   NC = lay->nc;
-  scratch = new_array(int, NC);
-  solution = new_array(int, NC);
-  start_point = lrand48() % NS;
+  start_point = ctx_random(ws->ctx) % NS;
+  if (parallel_speculate_p(ws)) {
+    return parallel_speculate(lay, ws, ic, start_point);
+  }
+
+  solution = NULL;
+  kept = 0;
   total_n_sol = 0;
-  n_poss = count_bits(ws_in->poss[ic]);
+  n_poss = set_count(ws->poss[ic]);
+  n_todo = ws->n_todo;
+  n_marked_todo = ws->n_marked_todo;
+  solvepos = ws->solvepos;
+  score = ws->score;
+  ++ws->spec_depth;
+  mark = ws->n_trail;
   for (i=0; i<NS; i++) {
     int ii = (i + start_point) % NS;
-    int mask = 1<<ii;
-    if (mask & ws_in->poss[ic]) {
-      struct ws *ws;
-      ws = clone_ws(ws_in);
-      memcpy(scratch, ws_in->state, NC * sizeof(int));
-      ws->state = scratch;
+    if (BIT(ii) & ws->poss[ic]) {
+      if (spec_cancelled(ws)) {
+        break;
+      }
+      ws->score = 0.0;
       --ws->n_todo;
       allocate(lay, ws, 0, ic, ii);
       n_sol = inner_infer(lay, ws);
+      clear_queues(lay, ws);
       if (n_sol > 0) {
-        memcpy(solution, scratch, NC * sizeof(int));
         total_n_sol += n_sol;
-        ws_in->score += ws->score * (double) n_poss;
-        if (ws_in->options & OPT_FIRST_ONLY) {
-          free_cloned_ws(lay, ws);
+        score += ws->score * (double) n_poss;
+        if ((ws->options & OPT_FIRST_ONLY) ||
+            ((ws->options & OPT_STOP_ON_2) && (total_n_sol >= 2))) {
+          /* Leave this solution in place. */
+          kept = 1;
           break;
         }
+        if (!solution) {
+          solution = new_array(signed char, NC);
+        }
+        memcpy(solution, ws->state, NC);
       }
-      if ((ws_in->options & OPT_STOP_ON_2) && (total_n_sol >= 2)) {
-        free_cloned_ws(lay, ws);
-        break;
+      undo_trail(ws, mark);
+      ws->n_todo = n_todo;
+      ws->n_marked_todo = n_marked_todo;
+      ws->solvepos = solvepos;
+    }
+  }
+  --ws->spec_depth;
+  ws->score = score;
+
+  if (solution) {
+    if (!kept) {
+      /* Put back the last solution found.  (Trailed, in case this is itself
+       * inside a guess that gets backed out.) */
+      for (i=0; i<NC; i++) {
+        if (ws->state[i] != solution[i]) {
+          set_state(ws, i, solution[i]);
+        }
       }
-      free_cloned_ws(lay, ws);
+      ws->maps_stale = ws->part_clock;
     }
+    free(solution);
   }
-  free(scratch);
-  memcpy(ws_in->state, solution, NC * sizeof(int));
-  free(solution);
   return total_n_sol;
 }
 /*}}}*/
 
 /* ============================================================================ */
 
-static void do_scoring(struct layout *lay, struct ws *ws)/*{{{*/
+static void do_scoring(const struct layout *lay, struct ws *ws)/*{{{*/
 {
   /* Determine an increment for the score based on how 'hard' the puzzle is to
    * advance at this stage. */
@@ -1216,23 +1780,22 @@ static void do_scoring(struct layout *lay, struct ws *ws)/*{{{*/
 
 /* ============================================================================ */
 
-static int inner_infer(struct layout *lay, struct ws *ws)/*{{{*/
+static int inner_infer(const struct layout *lay, struct ws *ws)/*{{{*/
 {
-  int NC, NG, NS;
   int result;
   struct queue *q;
   int do_rescore;
 
-  NC = lay->nc;
-  NG = lay->ng;
-  NS = lay->ns;
-
   q = ws->base_q;
   result = 0;
   do_rescore = 1;
 
   while (q) { /* i.e. we still have a queue left to look at */
-    struct link *lk;
+    int index;
+
+    if (spec_cancelled(ws)) {
+      goto get_out;
+    }
 
     if ((ws->options & OPT_SCORE) && do_rescore) {
       /* Only score after some progress has been made. */
@@ -1240,13 +1803,13 @@ static int inner_infer(struct layout *lay, struct ws *ws)/*{{{*/
       do_rescore = 0;
     }
 
-    lk = dequeue(q);
-    if (lk) {
+    index = dequeue(q);
+    if (index >= 0) {
       int status;
 #if 0
-      fprintf(stderr, "Running %s on %d\n", q->name, lk->index);
+      fprintf(stderr, "Running %s on %d\n", q->name, index);
 #endif
-      status = (q->worker)(lk->index, lay, ws, q->opt, NULL);
+      status = (q->worker)(index, lay, ws, q->opt, NULL);
 #if 0
       fprintf(stderr, "  status = %d\n", status);
 #endif
@@ -1258,7 +1821,7 @@ static int inner_infer(struct layout *lay, struct ws *ws)/*{{{*/
           /* Try applying a harder rule on this group (if it doesn't get moved
            * back to the simplest queue first.) */
           if (q->next_to_push) {
-            enqueue(lk, q->next_to_push);
+            enqueue(index, q->next_to_push);
           }
           break;
         case 1:
@@ -1284,11 +1847,13 @@ static int inner_infer(struct layout *lay, struct ws *ws)/*{{{*/
 
   if (ws->n_todo == 0) {
     if ((ws->options & (OPT_SPECULATE | OPT_SHOW_ALL)) == (OPT_SPECULATE | OPT_SHOW_ALL)) {
-      /* ugh, ought to be via an argument */
-      static int sol_no = 1;
-      printf("Solution %d:\n", sol_no++);
-      display(stdout, lay, ws->state);
-      printf("\n");
+      int *grid = new_array(int, lay->nc);
+      int i;
+      for (i=0; i<lay->nc; i++) grid[i] = ws->state[i];
+      fprintf(ws->ctx->out, "Solution %d:\n", ++ws->ctx->sol_no);
+      display(ws->ctx->out, lay, grid);
+      fprintf(ws->ctx->out, "\n");
+      free(grid);
     }
     result = 1;
   } else if (ws->n_todo > 0) {
@@ -1308,94 +1873,137 @@ get_out:
   
 }
 /*}}}*/
+static void setup_queues(struct ws *ws, const struct constraint *simplify_cons, int options)/*{{{*/
+{
+  /* Set up work queues */
+  struct queue *next_run, *next_cell_push, *next_line_push, *next_block_push, *next_group_push;
+  const struct group_workers *w;
+  int k;
+  int id = 0;
+
+  for (w = group_workers; w->ns && (w->ns != ws->ns); w++) ;
+
+  ws->group_changed = new_array(long, ws->ng);
+  memset(ws->group_changed, 0, ws->ng * sizeof(long));
+  if (simplify_cons->max_partition_size >= 2) {
+    ws->maps_built = new_array(long, ws->ng);
+    memset(ws->maps_built, 0, ws->ng * sizeof(long));
+    ws->part_index = new_array(int, ws->ng * 2 * ws->ns);
+    ws->part_sets = new_array(SYMSET, ws->ng * 2 * ws->ns);
+  }
+
+  next_run = NULL;
+  next_cell_push = NULL;
+  next_group_push = NULL;
+
+  for (k = simplify_cons->max_partition_size; k >= 2; k--) {
+    struct queue *our_q;
+    char name[24];
+    sprintf(name, "Partition %d", k);
+    our_q = mk_queue(w->partition, next_run, next_group_push, k, name, &ws->groups, id++);
+    next_run = next_group_push = our_q;
+  }
+  if (simplify_cons->do_subsets) {
+    struct queue *our_q = mk_queue(w->subsets, next_run, next_group_push, 0, "Subsets", &ws->groups, id++);
+    next_run = next_group_push = our_q;
+  }
+  if (!(options & OPT_ONLYOPT_FIRST)) {
+    if (simplify_cons->do_onlyopt) {
+      struct queue *our_q = mk_queue(try_onlyopt, next_run, next_cell_push, 0, "Onlyopt", &ws->cells, id++);
+      next_run = next_cell_push = our_q;
+    }
+  }
+
+  /* TODO : eventually, the earlier queues may be split into separate block
+   * and line variants. */
+  next_block_push = next_group_push;
+  next_line_push  = next_group_push;
+
+  if (simplify_cons->do_lines) {
+    struct queue *our_q = mk_queue(w->group_allocate, next_run, next_line_push, 0, "Lines", &ws->groups, id++);
+    next_run = next_line_push = our_q;
+  }
+  if (1) { /* allocate in blocks. */
+    struct queue *our_q = mk_queue(w->group_allocate, next_run, next_block_push, 0, "Blocks", &ws->groups, id++);
+    next_run = next_block_push = our_q;
+  }
+
+  if (options & OPT_ONLYOPT_FIRST) {
+    if (simplify_cons->do_onlyopt) {
+      struct queue *our_q = mk_queue(try_onlyopt, next_run, next_cell_push, 0, "Onlyopt", &ws->cells, id++);
+      next_run = next_cell_push = our_q;
+    }
+  }
+
+  ws->base_q = next_run;
+  ws->base_block_q = next_block_push;
+  ws->base_line_q = next_line_push;
+  ws->base_cell_q = next_cell_push;
+}
+/*}}}*/
 /*{{{ infer() */
-int infer(struct layout *lay,
-    int *state, int *order,
+static int use_bb9_p(const struct layout *lay, const int *state,
+    const int *order, const char *terminal, const int *score, int options)/*{{{*/
+{
+  /* Whether the caller only wants the number of solutions (and one of them),
+   * so that the rules don't matter and bb9.c can do the job. */
+  int i;
+  if (!lay->is_plain_9x9) return 0;
+  if (!(options & OPT_SPECULATE)) return 0;
+  if (options & (OPT_VERBOSE | OPT_HINT | OPT_SCORE | OPT_SHOW_ALL | OPT_SOLVE_MARKED)) return 0;
+  if (order || terminal || score) return 0;
+  for (i=0; i<lay->nc; i++) {
+    if (state[i] < CELL_EMPTY) return 0;
+  }
+  return 1;
+}
+/*}}}*/
+int infer(struct context *ctx, const struct layout *lay,
+    int *state, int *order, char *terminal,
     int *score,
     const struct constraint *simplify_cons, int options)
 {
-  int nc, ng, ns;
+  int nc;
+  struct solver_plan *plan;
   struct ws *ws;
   int i;
   int result;
 
   nc = lay->nc;
-  ng = lay->ng;
-  ns = lay->ns;
+
+#if !defined(WIDE_SETS) && !defined(NARROW_SETS)
+  if (lay->ns > SET_BITS) {
+    return infer_wide(ctx, lay, state, order, terminal, score, simplify_cons, options);
+  }
+  if (lay->ns <= 16) {
+    return infer_narrow(ctx, lay, state, order, terminal, score, simplify_cons, options);
+  }
+#endif
+  if (use_bb9_p(lay, state, order, terminal, score, options)) {
+    result = bb9_solve(ctx, state,
+        (options & OPT_FIRST_ONLY) ? 1 : (options & OPT_STOP_ON_2) ? 2 : 0);
+    if (result) return result;
+    /* No solution: let the rules have a go, so that the grid shows how far
+     * they got, as it would without bb9.c. */
+  }
 
   if (score) {
     options |= OPT_SCORE;
   }
 
-  ws = make_ws(nc, ng, ns);
-  ws->solvepos = 0;
+  arena_reserve(&ctx->scratch, scratch_needed(lay));
+  plan = get_plan(ctx, lay, simplify_cons, options);
+  ws = plan->ws;
+  ws->ctx = ctx;
   ws->options = options;
-  ws->state = state;
   ws->order = order;
+  ws->terminal = terminal;
+  ws->cons = &plan->cons;
 
-  /* Set up work queues */
-  {
-    struct queue *next_run, *next_cell_push, *next_line_push, *next_block_push, *next_group_push;
-    next_run = NULL;
-    next_cell_push = NULL;
-    next_group_push = NULL;
-
-    if (simplify_cons->max_partition_size >= 5) {
-      struct queue *our_q = mk_queue(try_partition, next_run, next_group_push, 5, "Partition 5");
-      next_run = next_group_push = our_q;
-    }
-    if (simplify_cons->max_partition_size >= 4) {
-      struct queue *our_q = mk_queue(try_partition, next_run, next_group_push, 4, "Partition 4");
-      next_run = next_group_push = our_q;
-    }
-    if (simplify_cons->max_partition_size >= 3) {
-      struct queue *our_q = mk_queue(try_partition, next_run, next_group_push, 3, "Partition 3");
-      next_run = next_group_push = our_q;
-    }
-    if (simplify_cons->max_partition_size >= 2) {
-      struct queue *our_q = mk_queue(try_partition, next_run, next_group_push, 2, "Partition 2");
-      next_run = next_group_push = our_q;
-    }
-    if (simplify_cons->do_subsets) {
-      struct queue *our_q = mk_queue(try_subsets, next_run, next_group_push, 0, "Subsets");
-      next_run = next_group_push = our_q;
-    }
-    if (!(options & OPT_ONLYOPT_FIRST)) {
-      if (simplify_cons->do_onlyopt) {
-        struct queue *our_q = mk_queue(try_onlyopt, next_run, next_cell_push, 0, "Onlyopt");
-        next_run = next_cell_push = our_q;
-      }
-    }
-
-    /* TODO : eventually, the earlier queues may be split into separate block
-     * and line variants. */
-    next_block_push = next_group_push;
-    next_line_push  = next_group_push;
-
-    if (simplify_cons->do_lines) {
-      struct queue *our_q = mk_queue(try_group_allocate, next_run, next_line_push, 0, "Lines");
-      next_run = next_line_push = our_q;
-    }
-    if (1) { /* allocate in blocks. */
-      struct queue *our_q = mk_queue(try_group_allocate, next_run, next_block_push, 0, "Blocks");
-      next_run = next_block_push = our_q;
-    }
-
-    if (options & OPT_ONLYOPT_FIRST) {
-      if (simplify_cons->do_onlyopt) {
-        struct queue *our_q = mk_queue(try_onlyopt, next_run, next_cell_push, 0, "Onlyopt");
-        next_run = next_cell_push = our_q;
-      }
-    }
-
-    ws->base_q = next_run;
-    ws->base_block_q = next_block_push;
-    ws->base_line_q = next_line_push;
-    ws->base_cell_q = next_cell_push;
+  for (i=0; i<nc; i++) {
+    ws->state[i] = state[i];
   }
 
-  set_base_queues(lay, ws);
-
   if (options & OPT_SOLVE_MARKED) {
     int i;
     ws->n_marked_todo = 0;
@@ -1418,11 +2026,14 @@ int infer(struct layout *lay,
   }
 
   result = inner_infer(lay, ws);
+  for (i=0; i<nc; i++) {
+    state[i] = ws->state[i];
+  }
   if (score) {
     *score = (int)(0.5 + ws->score);
   }
 
-  free_ws(ws);
+  plan->busy = 0;
   return result;
 
 }
@@ -36,6 +36,33 @@ const static char symbols_25[25] = {/*{{{*/
   'V', 'W', 'X', 'Y', 'Z'
 };
 /*}}}*/
+const static char symbols_64[64] = {/*{{{*/
+  /* Bigger sizes use as much of this as they need. */
+  '0', '1', '2', '3', '4', '5', '6', '7',
+  '8', '9', 'A', 'B', 'C', 'D', 'E', 'F',
+  'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N',
+  'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V',
+  'W', 'X', 'Y', 'Z', 'a', 'b', 'c', 'd',
+  'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l',
+  'm', 'n', 'o', 'p', 'q', 'r', 's', 't',
+  'u', 'v', 'w', 'x', 'y', 'z', '@', '$'
+};
+/*}}}*/
+static const char *row_label(int row)/*{{{*/
+{
+  /* A..Z, then AA, AB, ... for grids with more than 26 rows. */
+  static char buffer[3];
+  if (row < 26) {
+    buffer[0] = 'A' + row;
+    buffer[1] = '\0';
+  } else {
+    buffer[0] = 'A' + (row / 26) - 1;
+    buffer[1] = 'A' + (row % 26);
+    buffer[2] = '\0';
+  }
+  return buffer;
+}
+/*}}}*/
 void layout_MxN(int M, int N, int x_layout, struct layout *lay, int options) /*{{{*/
 {
   /* This function is REQUIRED to return the cells in raster scan order.
@@ -48,12 +75,13 @@ void layout_MxN(int M, int N, int x_layout, struct layout *lay, int options) /*{
    */
 
   int i, j, m, n;
-  int k;
   int MN = M*N;
   int NC, NG, NS;
   char buffer[32];
 
   lay->ns = NS = MN;
+  lay->map = NULL;
+  lay->map_size = 0;
   NG = 3*MN;
   if (x_layout) NG += 2;
   lay->ng = NG;
@@ -64,13 +92,16 @@ void layout_MxN(int M, int N, int x_layout, struct layout *lay, int options) /*{
     lay->symbols = symbols_9;
   } else if (MN <= 16) {
     lay->symbols = symbols_16;
-  } else if (MN == 25) {
+  } else if (MN <= 25) {
     lay->symbols = symbols_25;
+  } else if (MN <= MAX_SYMBOLS) {
+    lay->symbols = symbols_64;
   } else {
     fprintf(stderr, "No symbol table for MxN=%d\n", MN);
     exit(1);
   }
   lay->cells = new_array(struct cell, lay->nc);
+  lay->is_overlap = new_array(char, lay->nc);
   lay->groups = new_array(short, NG * NS);
   lay->is_block = new_array(char, NG);
   for (i=0; i<N; i++) {
@@ -81,14 +112,8 @@ void layout_MxN(int M, int N, int x_layout, struct layout *lay, int options) /*{
           int col = N*m+n;
           int block = M*i+m;
           int ic = MN*row + col;
-          sprintf(buffer, "%c%d", 'A'+row, 1+col);
+          sprintf(buffer, "%s%d", row_label(row), 1+col);
           lay->cells[ic].name = strdup(buffer);
-          lay->cells[ic].group[0] = row;
-          lay->cells[ic].group[1] = MN + col;
-          lay->cells[ic].group[2] = 2*MN + block;
-          for (k=3; k<NDIM; k++) {
-            lay->cells[ic].group[k] = -1;
-          }
           /* Put spacers every N rows/cols in the printout. */
           lay->cells[ic].prow = row + (row / M);
           lay->cells[ic].pcol = col + (col / N);
@@ -97,7 +122,7 @@ void layout_MxN(int M, int N, int x_layout, struct layout *lay, int options) /*{
           lay->groups[MN*(row) + col] = ic;
           lay->groups[MN*(MN+col) + row] = ic;
           lay->groups[MN*(2*MN+block) + N*j + n] = ic;
-          lay->cells[ic].is_overlap = 0;
+          lay->is_overlap[ic] = 0;
         }
       }
     }
@@ -105,13 +130,13 @@ void layout_MxN(int M, int N, int x_layout, struct layout *lay, int options) /*{
   lay->group_names = new_array(char *, NG);
   for (i=0; i<MN; i++) {
     char buffer[32];
-    sprintf(buffer, "row-%c", 'A' + i);
+    sprintf(buffer, "row-%s", row_label(i));
     lay->group_names[i] = strdup(buffer);
     lay->is_block[i] = 0;
     sprintf(buffer, "col-%d", 1 + i);
     lay->group_names[i+MN] = strdup(buffer);
     lay->is_block[i+MN] = 0;
-    sprintf(buffer, "blk-%c%d", 'A' + M*(i/M), 1 + N*(i%M));
+    sprintf(buffer, "blk-%s%d", row_label(M*(i/M)), 1 + N*(i%M));
     lay->group_names[i+2*MN] = strdup(buffer);
     lay->is_block[i+2*MN] = 1;
   }
@@ -126,13 +151,6 @@ void layout_MxN(int M, int N, int x_layout, struct layout *lay, int options) /*{
     ci0 = 0;
     ci1 = NS - 1;
     for (i=0; i<NS; i++) {
-      lay->cells[ci0].group[3] = NG - 2;
-      if (ci0 == ci1) {
-        /* Central square if MN is odd */
-        lay->cells[ci1].group[4] = NG - 1;
-      } else {
-        lay->cells[ci1].group[3] = NG - 1;
-      }
       base0[i] = ci0;
       base1[i] = ci1;
       ci0 += (NS + 1);
@@ -177,7 +195,12 @@ void layout_MxN(int M, int N, int x_layout, struct layout *lay, int options) /*{
     d->y0 = 0, d->y1 = MN;
   }
 
+  lay->is_plain_9x9 = plain_9x9_p(lay);
   find_symmetries(lay, options);
+  find_cell_groups(lay);
+  find_peers(lay);
+  find_intersections(lay);
+  find_overlap_cells(lay);
 }
 /*}}}*/
 
@@ -187,8 +210,19 @@ void free_layout_lite(struct layout *lay)/*{{{*/
   free(lay->mediumlines);
   free(lay->thicklines);
   free(lay->groups);
+  free(lay->peer_index);
+  free(lay->peers);
+  free(lay->isect_index);
+  free(lay->isect_group);
+  free(lay->isect_mask);
+  free(lay->isect_other);
+  free(lay->overlap_cells);
   free(lay->group_names);
   free(lay->cells);
+  free(lay->cell_group_index);
+  free(lay->cell_groups);
+  free(lay->is_overlap);
+  free(lay->isym);
   if (lay->name) free(lay->name);
   free(lay->is_block);
 }
@@ -196,10 +230,21 @@ void free_layout_lite(struct layout *lay)/*{{{*/
 void free_layout(struct layout *lay)/*{{{*/
 {
   int i;
+  if (lay->map) {
+    free_mapped_layout(lay);
+    return;
+  }
   free(lay->thinlines);
   free(lay->mediumlines);
   free(lay->thicklines);
   free(lay->groups);
+  free(lay->peer_index);
+  free(lay->peers);
+  free(lay->isect_index);
+  free(lay->isect_group);
+  free(lay->isect_mask);
+  free(lay->isect_other);
+  free(lay->overlap_cells);
   for (i=0; i<lay->ng; i++) {
     free(lay->group_names[i]);
   }
@@ -208,6 +253,10 @@ void free_layout(struct layout *lay)/*{{{*/
     free(lay->cells[i].name);
   }
   free(lay->cells);
+  free(lay->cell_group_index);
+  free(lay->cell_groups);
+  free(lay->is_overlap);
+  free(lay->isym);
   free(lay->name);
   free(lay->is_block);
   free(lay);
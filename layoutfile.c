@@ -0,0 +1,683 @@
+/*
+ *  sku - analysis tool for Sudoku puzzles
+ *  Copyright (C) 2005  Richard P. Curnow
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/* Layouts read from files, for interlocked grids that aren't built in.
+ *
+ * A '#layout: @<file>' header names a file instead of a built-in layout.  The
+ * file holds either a description of the layout, as below, or its compiled
+ * form (written by 'sku -C'), which has all the tables worked out already and
+ * is mapped into memory as it stands.
+ *
+ * A description has one item per line, and '#' starts a comment.  The blocks
+ * come first, and grids before the links and groups that refer to them.
+ *
+ *   blocks <shape>
+ *       The shape of the blocks, as in the layout names: "3", "23", "2,10",
+ *       with an 'x' in front for diagonal groups in each grid.
+ *   grid <name> <row> <col>
+ *       A grid and where it goes.  The steps are the size of a grid less one
+ *       block, so two grids a step apart diagonally share a corner block.  The
+ *       name (up to 16 characters) goes in front of the names of its cells.
+ *   link <grid> <corner> <grid> <corner>
+ *       The two grids share these corner blocks (NW, NE, SW or SE.)  Grids
+ *       can only overlap where they are linked.
+ *   group <name> <cell>...
+ *       An extra group, with a cell for each symbol, given as <grid>:<cell>
+ *       (e.g. C:E5.)
+ *
+ * The standard 5-gattai, for example, is
+ *
+ *   blocks 3
+ *   grid NW 0 0
+ *   grid NE 0 2
+ *   grid SW 2 0
+ *   grid SE 2 2
+ *   grid C 1 1
+ *   link NW SE C NW
+ *   link NE SW C NE
+ *   link SW NE C SW
+ *   link SE NW C SE
+ */
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sku.h"
+
+#define MAX_GRID_NAME 16
+/* Cells and groups are numbered with shorts. */
+#define MAX_INDEX 32767
+
+struct description {/*{{{*/
+  const char *path;
+  int line;
+  int M, N;             /* block shape, 0 until the 'blocks' line */
+  int x_layout;
+  int max_subgrids;
+  int max_links;
+  int max_groups;
+};
+/*}}}*/
+static void bad_description(const struct description *d, const char *fmt, ...)/*{{{*/
+{
+  va_list ap;
+  fprintf(stderr, "%s:%d: ", d->path, d->line);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+/*}}}*/
+static int parse_offset(const struct description *d, const char *x)/*{{{*/
+{
+  char *end;
+  long n = strtol(x, &end, 10);
+  if ((*end != '\0') || (end == x) || (n < 0) || (n > 1000)) {
+    bad_description(d, "bad grid offset %s", x);
+  }
+  return (int) n;
+}
+/*}}}*/
+static enum corner parse_corner(const struct description *d, const char *x)/*{{{*/
+{
+  if (!strcmp(x, "NW")) return NW;
+  if (!strcmp(x, "NE")) return NE;
+  if (!strcmp(x, "SE")) return SE;
+  if (!strcmp(x, "SW")) return SW;
+  bad_description(d, "bad corner %s (should be NW, NE, SW or SE)", x);
+  return NW;
+}
+/*}}}*/
+static int find_subgrid(const struct description *d, const struct super_layout *superlay, const char *name, int len)/*{{{*/
+{
+  int i;
+  for (i=0; i<superlay->n_subgrids; i++) {
+    const char *sg = superlay->subgrids[i].name;
+    if (((int) strlen(sg) == len) && !strncmp(sg, name, len)) return i;
+  }
+  bad_description(d, "no grid called %.*s", len, name);
+  return -1;
+}
+/*}}}*/
+static int parse_cell(const struct description *d, const struct super_layout *superlay, const char *x)/*{{{*/
+{
+  /* <grid>:<cell>, with the cell named as in layout_MxN(): the row as A..Z
+   * then AA, AB, ..., and the column from 1. */
+  const char *colon = strchr(x, ':');
+  const char *p;
+  int MN = d->M * d->N;
+  int grid, row, col;
+  if (!colon) {
+    bad_description(d, "cell %s should be given as <grid>:<cell>", x);
+  }
+  grid = find_subgrid(d, superlay, x, colon - x);
+  p = colon + 1;
+  if (!isupper((unsigned char) *p)) {
+    bad_description(d, "bad cell %s", x);
+  }
+  row = *p++ - 'A';
+  if (isupper((unsigned char) *p)) {
+    row = 26 * (row + 1) + (*p++ - 'A');
+  }
+  col = 0;
+  while (isdigit((unsigned char) *p)) {
+    col = 10*col + (*p++ - '0');
+    if (col > MN) break;
+  }
+  if (*p || (row >= MN) || (col < 1) || (col > MN)) {
+    bad_description(d, "bad cell %s", x);
+  }
+  return grid * MN * MN + row * MN + (col - 1);
+}
+/*}}}*/
+static void corner_origin(int M, int N, enum corner c, int *row, int *col)/*{{{*/
+{
+  /* Top left of the block in that corner of a grid */
+  *row = ((c == SW) || (c == SE)) ? M*N - M : 0;
+  *col = ((c == NE) || (c == SE)) ? M*N - N : 0;
+}
+/*}}}*/
+static void add_grid(struct description *d, struct super_layout *superlay, int argc, char **argv)/*{{{*/
+{
+  struct subgrid *sg;
+  int i;
+  if (argc != 4) {
+    bad_description(d, "expected 'grid <name> <row> <col>'");
+  }
+  if ((strlen(argv[1]) > MAX_GRID_NAME) || strchr(argv[1], ':') || strchr(argv[1], '/')) {
+    bad_description(d, "bad grid name %s", argv[1]);
+  }
+  for (i=0; i<superlay->n_subgrids; i++) {
+    if (!strcmp(superlay->subgrids[i].name, argv[1])) {
+      bad_description(d, "there is already a grid called %s", argv[1]);
+    }
+  }
+  if (superlay->n_subgrids == d->max_subgrids) {
+    d->max_subgrids = d->max_subgrids ? 2 * d->max_subgrids : 8;
+    superlay->subgrids = (struct subgrid *) realloc(superlay->subgrids, d->max_subgrids * sizeof(struct subgrid));
+  }
+  sg = superlay->subgrids + superlay->n_subgrids++;
+  sg->name = strdup(argv[1]);
+  sg->yoff = parse_offset(d, argv[2]);
+  sg->xoff = parse_offset(d, argv[3]);
+}
+/*}}}*/
+static void add_link(struct description *d, struct super_layout *superlay, int argc, char **argv)/*{{{*/
+{
+  struct subgrid_link link;
+  const struct subgrid *sg0, *sg1;
+  int M = d->M, N = d->N;
+  int row0, col0, row1, col1;
+  if (argc != 5) {
+    bad_description(d, "expected 'link <grid> <corner> <grid> <corner>'");
+  }
+  link.index0 = find_subgrid(d, superlay, argv[1], strlen(argv[1]));
+  link.corner0 = parse_corner(d, argv[2]);
+  link.index1 = find_subgrid(d, superlay, argv[3], strlen(argv[3]));
+  link.corner1 = parse_corner(d, argv[4]);
+  if (link.index0 == link.index1) {
+    bad_description(d, "can't link grid %s to itself", argv[1]);
+  }
+  /* The corners have to be in the same place, allowing for where the grids
+   * are. */
+  sg0 = superlay->subgrids + link.index0;
+  sg1 = superlay->subgrids + link.index1;
+  corner_origin(M, N, link.corner0, &row0, &col0);
+  corner_origin(M, N, link.corner1, &row1, &col1);
+  row0 += sg0->yoff * M*(N-1);
+  col0 += sg0->xoff * N*(M-1);
+  row1 += sg1->yoff * M*(N-1);
+  col1 += sg1->xoff * N*(M-1);
+  if ((row0 != row1) || (col0 != col1)) {
+    bad_description(d, "the %s corner of %s isn't on the %s corner of %s",
+        argv[2], argv[1], argv[4], argv[3]);
+  }
+  if (superlay->n_links == d->max_links) {
+    d->max_links = d->max_links ? 2 * d->max_links : 8;
+    superlay->links = (struct subgrid_link *) realloc(superlay->links, d->max_links * sizeof(struct subgrid_link));
+  }
+  superlay->links[superlay->n_links++] = link;
+}
+/*}}}*/
+static void add_group(struct description *d, struct super_layout *superlay, int argc, char **argv)/*{{{*/
+{
+  struct extra_group *eg;
+  int MN = d->M * d->N;
+  int i;
+  if (argc != MN + 2) {
+    bad_description(d, "expected 'group <name>' and %d cells", MN);
+  }
+  if (superlay->n_groups == d->max_groups) {
+    d->max_groups = d->max_groups ? 2 * d->max_groups : 8;
+    superlay->groups = (struct extra_group *) realloc(superlay->groups, d->max_groups * sizeof(struct extra_group));
+  }
+  eg = superlay->groups + superlay->n_groups++;
+  eg->name = strdup(argv[1]);
+  eg->cells = new_array(int, MN);
+  for (i=0; i<MN; i++) {
+    eg->cells[i] = parse_cell(d, superlay, argv[i+2]);
+  }
+}
+/*}}}*/
+static void read_description(FILE *in, struct description *d, struct super_layout *superlay)/*{{{*/
+{
+  char *buffer = NULL;
+  size_t size = 0;
+  char *argv[MAX_SYMBOLS + 2];
+  int MN, ng;
+
+  d->line = 0;
+  d->M = d->N = 0;
+  d->x_layout = 0;
+  d->max_subgrids = d->max_links = d->max_groups = 0;
+  superlay->n_subgrids = 0;
+  superlay->subgrids = NULL;
+  superlay->n_links = 0;
+  superlay->links = NULL;
+  superlay->n_groups = 0;
+  superlay->groups = NULL;
+
+  while (getline(&buffer, &size, in) >= 0) {
+    char *comment, *tok, *save;
+    int argc = 0;
+    ++d->line;
+    comment = strchr(buffer, '#');
+    if (comment) *comment = '\0';
+    for (tok = strtok_r(buffer, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+      if (argc == MAX_SYMBOLS + 2) {
+        bad_description(d, "too many words");
+      }
+      argv[argc++] = tok;
+    }
+    if (argc == 0) continue;
+
+    if (!strcmp(argv[0], "blocks")) {
+      const char *shape;
+      if (argc != 2) bad_description(d, "expected 'blocks <shape>'");
+      if (d->M) bad_description(d, "the blocks are already given");
+      shape = argv[1];
+      if (*shape == 'x') {
+        d->x_layout = 1;
+        shape++;
+      }
+      parse_mn(shape, strlen(shape), &d->M, &d->N);
+    } else if (!d->M) {
+      bad_description(d, "the blocks have to be given first");
+    } else if (!strcmp(argv[0], "grid")) {
+      add_grid(d, superlay, argc, argv);
+    } else if (!strcmp(argv[0], "link")) {
+      add_link(d, superlay, argc, argv);
+    } else if (!strcmp(argv[0], "group")) {
+      add_group(d, superlay, argc, argv);
+    } else {
+      bad_description(d, "unknown item %s", argv[0]);
+    }
+  }
+  free(buffer);
+
+  if (superlay->n_subgrids == 0) {
+    bad_description(d, "no grids");
+  }
+  MN = d->M * d->N;
+  ng = superlay->n_subgrids * (3*MN + (d->x_layout ? 2 : 0)) + superlay->n_groups;
+  if ((superlay->n_subgrids * MN * MN > MAX_INDEX) || (ng > MAX_INDEX)) {
+    bad_description(d, "the layout is too big");
+  }
+}
+/*}}}*/
+
+/* ============================================================================ */
+
+/* The compiled form is a header and then the tables, each starting on an
+ * 8-byte boundary, in the order of enum section.  It is only meant to be read
+ * back on the same kind of machine. */
+
+#define COMPILED_MAGIC "sku-layout1"
+
+enum section {/*{{{*/
+  S_SYMBOLS,            /* char [ns] */
+  S_COORDS,             /* short [nc*4]: prow, pcol, rrow, rcol */
+  S_IS_OVERLAP,         /* char [nc] */
+  S_IS_BLOCK,           /* char [ng] */
+  S_GROUPS,             /* short [ng*ns] */
+  S_CELL_GROUP_INDEX,   /* int [nc+1] */
+  S_CELL_GROUPS,        /* short [ng*ns] */
+  S_PEER_INDEX,         /* int [ng*ns+1] */
+  S_PEERS,              /* short [n_peers] */
+  S_ISECT_INDEX,        /* int [ng+1] */
+  S_ISECT_GROUP,        /* short [n_isect] */
+  S_ISECT_MASK,         /* unsigned long long [n_isect] */
+  S_ISECT_OTHER,        /* unsigned long long [n_isect] */
+  S_OVERLAP_CELLS,      /* short [n_overlap] */
+  S_LINES,              /* struct dline [thin + medium + thick] */
+  S_NAMES,              /* the cells' names then the groups', each with a NUL */
+  N_SECTIONS
+};
+/*}}}*/
+struct compiled_header {/*{{{*/
+  char magic[12];
+  unsigned int byte_order;      /* 0x01020304 as written */
+  int ns, nc, ng;
+  int prows, pcols;
+  int n_thinlines, n_mediumlines, n_thicklines;
+  int n_peers;
+  int n_isect;
+  int n_overlap;
+  int names_size;
+  unsigned int offset[N_SECTIONS];
+};
+/*}}}*/
+static void section_sizes(const struct compiled_header *h, size_t *size)/*{{{*/
+{
+  size_t nc = h->nc, ng = h->ng, ns = h->ns;
+  size[S_SYMBOLS] = ns;
+  size[S_COORDS] = nc * 4 * sizeof(short);
+  size[S_IS_OVERLAP] = nc;
+  size[S_IS_BLOCK] = ng;
+  size[S_GROUPS] = ng * ns * sizeof(short);
+  size[S_CELL_GROUP_INDEX] = (nc + 1) * sizeof(int);
+  size[S_CELL_GROUPS] = ng * ns * sizeof(short);
+  size[S_PEER_INDEX] = (ng * ns + 1) * sizeof(int);
+  size[S_PEERS] = (size_t) h->n_peers * sizeof(short);
+  size[S_ISECT_INDEX] = (ng + 1) * sizeof(int);
+  size[S_ISECT_GROUP] = (size_t) h->n_isect * sizeof(short);
+  size[S_ISECT_MASK] = (size_t) h->n_isect * sizeof(unsigned long long);
+  size[S_ISECT_OTHER] = (size_t) h->n_isect * sizeof(unsigned long long);
+  size[S_OVERLAP_CELLS] = (size_t) h->n_overlap * sizeof(short);
+  size[S_LINES] = (size_t) (h->n_thinlines + h->n_mediumlines + h->n_thicklines) * sizeof(struct dline);
+  size[S_NAMES] = h->names_size;
+}
+/*}}}*/
+#define ALIGN8(x) (((x) + 7) & ~(size_t) 7)
+
+void write_layout_file(FILE *out, const struct layout *lay)/*{{{*/
+{
+  struct compiled_header h;
+  size_t size[N_SECTIONS];
+  const void *data[N_SECTIONS];
+  short *coords;
+  char *names, *p;
+  struct dline *lines;
+  size_t pos;
+  int i, n_lines;
+  static const char zeros[8];
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, COMPILED_MAGIC, sizeof(COMPILED_MAGIC));
+  h.byte_order = 0x01020304;
+  h.ns = lay->ns;
+  h.nc = lay->nc;
+  h.ng = lay->ng;
+  h.prows = lay->prows;
+  h.pcols = lay->pcols;
+  h.n_thinlines = lay->n_thinlines;
+  h.n_mediumlines = lay->n_mediumlines;
+  h.n_thicklines = lay->n_thicklines;
+  h.n_peers = lay->peer_index[lay->ng * lay->ns];
+  h.n_isect = lay->isect_index[lay->ng];
+  h.n_overlap = lay->n_overlap;
+  h.names_size = 0;
+  for (i=0; i<lay->nc; i++) h.names_size += strlen(lay->cells[i].name) + 1;
+  for (i=0; i<lay->ng; i++) h.names_size += strlen(lay->group_names[i]) + 1;
+
+  coords = new_array(short, 4 * lay->nc);
+  for (i=0; i<lay->nc; i++) {
+    coords[4*i + 0] = lay->cells[i].prow;
+    coords[4*i + 1] = lay->cells[i].pcol;
+    coords[4*i + 2] = lay->cells[i].rrow;
+    coords[4*i + 3] = lay->cells[i].rcol;
+  }
+  p = names = new_array(char, h.names_size);
+  for (i=0; i<lay->nc; i++) p = stpcpy(p, lay->cells[i].name) + 1;
+  for (i=0; i<lay->ng; i++) p = stpcpy(p, lay->group_names[i]) + 1;
+  n_lines = lay->n_thinlines + lay->n_mediumlines + lay->n_thicklines;
+  lines = new_array(struct dline, n_lines > 0 ? n_lines : 1);
+  memcpy(lines, lay->thinlines, lay->n_thinlines * sizeof(struct dline));
+  memcpy(lines + lay->n_thinlines, lay->mediumlines, lay->n_mediumlines * sizeof(struct dline));
+  memcpy(lines + lay->n_thinlines + lay->n_mediumlines, lay->thicklines, lay->n_thicklines * sizeof(struct dline));
+
+  data[S_SYMBOLS] = lay->symbols;
+  data[S_COORDS] = coords;
+  data[S_IS_OVERLAP] = lay->is_overlap;
+  data[S_IS_BLOCK] = lay->is_block;
+  data[S_GROUPS] = lay->groups;
+  data[S_CELL_GROUP_INDEX] = lay->cell_group_index;
+  data[S_CELL_GROUPS] = lay->cell_groups;
+  data[S_PEER_INDEX] = lay->peer_index;
+  data[S_PEERS] = lay->peers;
+  data[S_ISECT_INDEX] = lay->isect_index;
+  data[S_ISECT_GROUP] = lay->isect_group;
+  data[S_ISECT_MASK] = lay->isect_mask;
+  data[S_ISECT_OTHER] = lay->isect_other;
+  data[S_OVERLAP_CELLS] = lay->overlap_cells;
+  data[S_LINES] = lines;
+  data[S_NAMES] = names;
+
+  section_sizes(&h, size);
+  pos = ALIGN8(sizeof(h));
+  for (i=0; i<N_SECTIONS; i++) {
+    h.offset[i] = pos;
+    pos = ALIGN8(pos + size[i]);
+  }
+
+  fwrite(&h, sizeof(h), 1, out);
+  pos = sizeof(h);
+  for (i=0; i<N_SECTIONS; i++) {
+    fwrite(zeros, 1, h.offset[i] - pos, out);
+    fwrite(data[i], 1, size[i], out);
+    pos = h.offset[i] + size[i];
+  }
+  fwrite(zeros, 1, ALIGN8(pos) - pos, out);
+  fflush(out);
+  if (ferror(out)) {
+    fprintf(stderr, "Could not write the compiled layout\n");
+    exit(1);
+  }
+  free(coords);
+  free(names);
+  free(lines);
+}
+/*}}}*/
+static int index_ok(const int *index, int n, int total)/*{{{*/
+{
+  /* An index of n runs into a table of 'total' entries. */
+  int i;
+  if (index[0] != 0 || index[n] != total) return 0;
+  for (i=0; i<n; i++) {
+    if (index[i] > index[i+1]) return 0;
+  }
+  return 1;
+}
+/*}}}*/
+static int entries_ok(const short *x, int n, int limit)/*{{{*/
+{
+  int i;
+  for (i=0; i<n; i++) {
+    if ((x[i] < 0) || (x[i] >= limit)) return 0;
+  }
+  return 1;
+}
+/*}}}*/
+static const char *check_compiled(const struct compiled_header *h, size_t file_size, const char *base)/*{{{*/
+{
+  /* Returns what is wrong with the file, or NULL if it can be used. */
+  size_t size[N_SECTIONS];
+  const char *names;
+  int i, n;
+
+  if (h->byte_order != 0x01020304) return "written on another kind of machine";
+  if ((h->ns < 1) || (h->ns > MAX_SYMBOLS) ||
+      (h->nc < 1) || (h->nc > MAX_INDEX) ||
+      (h->ng < 1) || (h->ng > MAX_INDEX) ||
+      (h->n_peers < 0) || (h->n_isect < 0) ||
+      (h->n_overlap < 0) || (h->n_overlap > h->nc) ||
+      (h->n_thinlines < 0) || (h->n_mediumlines < 0) || (h->n_thicklines < 0) ||
+      (h->names_size < 0)) {
+    return "bad table sizes";
+  }
+  if ((h->prows < 1) || (h->prows > MAX_INDEX) ||
+      (h->pcols < 1) || (h->pcols > MAX_INDEX)) {
+    return "bad grid size";
+  }
+  section_sizes(h, size);
+  for (i=0; i<N_SECTIONS; i++) {
+    if ((h->offset[i] % 8) || (h->offset[i] < sizeof(*h)) ||
+        (h->offset[i] > file_size) || (size[i] > file_size - h->offset[i])) {
+      return "truncated";
+    }
+  }
+
+#define TABLE(T, s) ((const T *) (base + h->offset[s]))
+  for (i=0; i<h->ns; i++) {
+    char sym = TABLE(char, S_SYMBOLS)[i];
+    if (!isgraph((unsigned char) sym) || (sym == '.')) return "bad symbols";
+  }
+  for (i=0; i<h->nc; i++) {
+    const short *c = TABLE(short, S_COORDS) + 4*i;
+    if ((c[0] < 0) || (c[0] >= h->prows) || (c[1] < 0) || (c[1] >= h->pcols) ||
+        (c[2] < 0) || (c[3] < 0)) {
+      return "bad cell positions";
+    }
+  }
+  if (!entries_ok(TABLE(short, S_GROUPS), h->ng * h->ns, h->nc) ||
+      !index_ok(TABLE(int, S_CELL_GROUP_INDEX), h->nc, h->ng * h->ns) ||
+      !entries_ok(TABLE(short, S_CELL_GROUPS), h->ng * h->ns, h->ng) ||
+      !index_ok(TABLE(int, S_PEER_INDEX), h->ng * h->ns, h->n_peers) ||
+      !entries_ok(TABLE(short, S_PEERS), h->n_peers, h->nc) ||
+      !index_ok(TABLE(int, S_ISECT_INDEX), h->ng, h->n_isect) ||
+      !entries_ok(TABLE(short, S_ISECT_GROUP), h->n_isect, h->ng) ||
+      !entries_ok(TABLE(short, S_OVERLAP_CELLS), h->n_overlap, h->nc)) {
+    return "bad tables";
+  }
+  /* cell_groups has to be the other way round of groups */
+  for (i=0; i<h->ng * h->ns; i++) {
+    int ic = TABLE(short, S_GROUPS)[i];
+    int k, found = 0;
+    for (k = TABLE(int, S_CELL_GROUP_INDEX)[ic]; k < TABLE(int, S_CELL_GROUP_INDEX)[ic+1]; k++) {
+      if (TABLE(short, S_CELL_GROUPS)[k] == i / h->ns) found++;
+    }
+    if (found != 1) return "bad tables";
+  }
+  names = TABLE(char, S_NAMES);
+  n = 0;
+  for (i=0; i<h->names_size; i++) {
+    if (!names[i]) n++;
+  }
+  if ((n != h->nc + h->ng) || names[h->names_size - 1]) {
+    return "bad names";
+  }
+#undef TABLE
+  return NULL;
+}
+/*}}}*/
+static void map_compiled(const char *path, struct layout *lay, int options)/*{{{*/
+{
+  const struct compiled_header *h;
+  const struct dline *lines;
+  const short *coords;
+  const char *base, *names, *problem;
+  struct stat sb;
+  void *map;
+  int fd, i;
+
+  fd = open(path, O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &sb) < 0)) {
+    fprintf(stderr, "Can't open layout file %s\n", path);
+    exit(1);
+  }
+  if ((size_t) sb.st_size < sizeof(*h)) {
+    fprintf(stderr, "Compiled layout %s is truncated\n", path);
+    exit(1);
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Can't map layout file %s\n", path);
+    exit(1);
+  }
+  base = (const char *) map;
+  h = (const struct compiled_header *) map;
+  problem = check_compiled(h, sb.st_size, base);
+  if (problem) {
+    fprintf(stderr, "Can't use compiled layout %s (%s)\n", path, problem);
+    exit(1);
+  }
+
+  /* The tables are used where they are in the file.  Only the cells and the
+   * group names need pointers making up, and the symmetry rings depend on
+   * the options. */
+#define TABLE(T, s) ((T *) (base + h->offset[s]))
+  lay->ns = h->ns;
+  lay->nc = h->nc;
+  lay->ng = h->ng;
+  lay->prows = h->prows;
+  lay->pcols = h->pcols;
+  lines = TABLE(struct dline, S_LINES);
+  lay->n_thinlines = h->n_thinlines;
+  lay->thinlines = (struct dline *) lines;
+  lay->n_mediumlines = h->n_mediumlines;
+  lay->mediumlines = (struct dline *) lines + h->n_thinlines;
+  lay->n_thicklines = h->n_thicklines;
+  lay->thicklines = (struct dline *) lines + h->n_thinlines + h->n_mediumlines;
+  lay->symbols = TABLE(const char, S_SYMBOLS);
+  lay->is_overlap = TABLE(char, S_IS_OVERLAP);
+  lay->is_block = TABLE(char, S_IS_BLOCK);
+  lay->groups = TABLE(short, S_GROUPS);
+  lay->cell_group_index = TABLE(int, S_CELL_GROUP_INDEX);
+  lay->cell_groups = TABLE(short, S_CELL_GROUPS);
+  lay->peer_index = TABLE(int, S_PEER_INDEX);
+  lay->peers = TABLE(short, S_PEERS);
+  lay->isect_index = TABLE(int, S_ISECT_INDEX);
+  lay->isect_group = TABLE(short, S_ISECT_GROUP);
+  lay->isect_mask = TABLE(unsigned long long, S_ISECT_MASK);
+  lay->isect_other = TABLE(unsigned long long, S_ISECT_OTHER);
+  lay->n_overlap = h->n_overlap;
+  lay->overlap_cells = TABLE(short, S_OVERLAP_CELLS);
+  coords = TABLE(const short, S_COORDS);
+  names = TABLE(const char, S_NAMES);
+#undef TABLE
+
+  lay->cells = new_array(struct cell, lay->nc);
+  for (i=0; i<lay->nc; i++) {
+    struct cell *c = lay->cells + i;
+    c->name = (char *) names;
+    names += strlen(names) + 1;
+    c->index = i;
+    c->prow = coords[4*i + 0];
+    c->pcol = coords[4*i + 1];
+    c->rrow = coords[4*i + 2];
+    c->rcol = coords[4*i + 3];
+  }
+  lay->group_names = new_array(char *, lay->ng);
+  for (i=0; i<lay->ng; i++) {
+    lay->group_names[i] = (char *) names;
+    names += strlen(names) + 1;
+  }
+  lay->map = map;
+  lay->map_size = sb.st_size;
+
+  /* Worked out again rather than taken on trust, since bb9.c gives wrong
+   * answers for anything else. */
+  lay->is_plain_9x9 = plain_9x9_p(lay);
+  find_symmetries(lay, options);
+}
+/*}}}*/
+void free_mapped_layout(struct layout *lay)/*{{{*/
+{
+  free(lay->cells);
+  free(lay->group_names);
+  free(lay->isym);
+  free(lay->name);
+  munmap(lay->map, lay->map_size);
+  free(lay);
+}
+/*}}}*/
+
+/* ============================================================================ */
+
+void load_layout_file(const char *path, struct layout *lay, int options)/*{{{*/
+{
+  FILE *in;
+  char magic[sizeof(COMPILED_MAGIC)];
+  struct description d;
+  struct super_layout superlay;
+
+  in = fopen(path, "r");
+  if (!in) {
+    fprintf(stderr, "Can't open layout file %s\n", path);
+    exit(1);
+  }
+  if ((fread(magic, 1, sizeof(magic), in) == sizeof(magic)) &&
+      !memcmp(magic, COMPILED_MAGIC, sizeof(magic))) {
+    fclose(in);
+    map_compiled(path, lay, options);
+    return;
+  }
+  rewind(in);
+  d.path = path;
+  read_description(in, &d, &superlay);
+  fclose(in);
+  layout_MxN_superlay(d.M, d.N, d.x_layout, &superlay, lay, options);
+  free_superlayout(&superlay);
+}
+/*}}}*/
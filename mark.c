@@ -34,7 +34,7 @@ static int compare_intpair(const void *a, const void *b)/*{{{*/
 }
 /*}}}*/
 
-static void weed_terminals(struct layout *lay, int *order)/*{{{*/
+static void weed_terminals(struct layout *lay, int *order, char *terminal)/*{{{*/
 {
   char *dead_terminal;
   int i, j;
@@ -43,7 +43,7 @@ static void weed_terminals(struct layout *lay, int *order)/*{{{*/
 #if 0
   fprintf(stderr, "The following cells are terminals:\n");
   for (i=0; i<lay->nc; i++) {
-    if (lay->cells[i].is_terminal) {
+    if (terminal[i]) {
       fprintf(stderr, "  %4d : %s\n", order[i], lay->cells[i].name);
     }
   }
@@ -53,7 +53,7 @@ static void weed_terminals(struct layout *lay, int *order)/*{{{*/
     int highest = -1;
     for (j=0; j<lay->ns; j++) {
       int jc = base[j];
-      if (lay->cells[jc].is_terminal) {
+      if (terminal[jc]) {
         if (highest < order[jc]) {
           highest = order[jc];
         }
@@ -61,7 +61,7 @@ static void weed_terminals(struct layout *lay, int *order)/*{{{*/
     }
     for (j=0; j<lay->ns; j++) {
       int jc = base[j];
-      if (lay->cells[jc].is_terminal) {
+      if (terminal[jc]) {
         if (highest > order[jc]) {
           dead_terminal[jc] = 1;
         }
@@ -73,7 +73,7 @@ static void weed_terminals(struct layout *lay, int *order)/*{{{*/
 #if 0
       fprintf(stderr, "Weeding terminal <%s>\n", lay->cells[i].name);
 #endif
-      lay->cells[i].is_terminal = 0;
+      terminal[i] = 0;
     }
   }
 
@@ -81,35 +81,36 @@ static void weed_terminals(struct layout *lay, int *order)/*{{{*/
 #if 0
   fprintf(stderr, "The following cells remain as terminals:\n");
   for (i=0; i<lay->nc; i++) {
-    if (lay->cells[i].is_terminal) {
+    if (terminal[i]) {
       fprintf(stderr, "  %4d : %s\n", order[i], lay->cells[i].name);
     }
   }
 #endif
 }
 /*}}}*/
-void mark_cells(int grey_cells, const struct constraint *simplify_cons, int options)/*{{{*/
+static void mark_grid(struct context *ctx, struct layout *lay, int *state, const struct op_args *args)/*{{{*/
 {
-  int *state;
+  const struct constraint *simplify_cons = args->simplify_cons;
+  int grey_cells = args->grey_cells;
+  int options = args->options;
   int *copy;
   struct intpair *shade = NULL;
   int *order;
+  char *terminal;
   int i, j;
-  struct layout *lay;
   int score;
 
-  read_grid(&lay, &state, options);
-
   if (grey_cells > 0) {
     order = new_array(int, lay->nc);
     copy = new_array(int, lay->nc);
     memcpy(copy, state, lay->nc * sizeof(int));
     memset(order, 0, lay->nc * sizeof(int));
+    terminal = new_array(char, lay->nc);
+    memset(terminal, 1, lay->nc * sizeof(char));
     
-    setup_terminals(lay);
-    infer(lay, copy, order, &score, simplify_cons, OPT_SPECULATE);
+    infer(ctx, lay, copy, order, terminal, &score, simplify_cons, OPT_SPECULATE);
     fprintf(stderr, "SCORE : %d\n", score);
-    weed_terminals(lay, order);
+    weed_terminals(lay, order, terminal);
 
     shade = new_array(struct intpair, lay->nc);
     for (i=0; i<lay->nc; i++) {
@@ -126,7 +127,7 @@ void mark_cells(int grey_cells, const struct constraint *simplify_cons, int opti
         int ix, ord;
         ix = shade[i].a;
         ord = shade[i].b;
-        if (lay->cells[ix].is_terminal) {
+        if (terminal[ix]) {
           fprintf(stderr, "  %3d : %4d : <%s>\n", pos++, ord, lay->cells[ix].name);
         }
       }
@@ -137,7 +138,7 @@ void mark_cells(int grey_cells, const struct constraint *simplify_cons, int opti
       int xc;
       do {
         ic = shade[j++].a;
-      } while ((j < lay->nc) && (!lay->cells[ic].is_terminal) && (state[ic] == CELL_EMPTY));
+      } while ((j < lay->nc) && (!terminal[ic]) && (state[ic] == CELL_EMPTY));
 
       /* The check for CELL_EMPTY above is for the case where we're marking
        * symmetric cells; if an earlier terminal was symmetric with cell 'ic'
@@ -159,14 +160,17 @@ void mark_cells(int grey_cells, const struct constraint *simplify_cons, int opti
       }
     }
     free(order);
+    free(terminal);
     free(copy);
     free(shade);
   }
 
-  display(stdout, lay, state);
-
-  free(state);
-  free_layout(lay);
+  display(ctx->out, lay, state);
+}
+/*}}}*/
+void mark_cells(const struct op_args *args)/*{{{*/
+{
+  for_each_grid(mark_grid, args);
 }
 /*}}}*/
 
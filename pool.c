@@ -0,0 +1,302 @@
+/*
+ *  sku - analysis tool for Sudoku puzzles
+ *  Copyright (C) 2005  Richard P. Curnow
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/* A small work-stealing thread pool.
+ *
+ * Each thread owns a deque of tasks.  A thread pushes new tasks onto the
+ * bottom of its own deque and takes work from there too (so nested work stays
+ * local and cache-warm); when its own deque is empty it steals from the top of
+ * another thread's deque.  The thread that created the pool is member 0, and
+ * joins in whenever it calls pool_wait().  Tasks are expected to be coarse
+ * (a whole puzzle, or a whole speculation subtree), so each deque simply has
+ * its own mutex.
+ */
+
+#include <pthread.h>
+
+#include "sku.h"
+
+struct task {/*{{{*/
+  TASK_FN fn;
+  void *arg;
+  struct task_group *group;
+};
+/*}}}*/
+struct deque {/*{{{*/
+  pthread_mutex_t lock;
+  struct task *tasks;   /* circular buffer */
+  int size;             /* allocated length of tasks[] */
+  int head;             /* index of oldest task (stolen from here) */
+  int n;                /* number of tasks present */
+};
+/*}}}*/
+struct pool {/*{{{*/
+  int n_threads;
+  pthread_t *threads;   /* [n_threads]; [0] unused, it's the creating thread */
+  struct deque *deques; /* [n_threads] */
+
+  /* For putting idle threads to sleep. */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t progress;      /* for pool_wait(): a task was queued or a
+                                   group has finished */
+  int n_queued;         /* updated atomically; tasks sitting in any deque */
+  int shutdown;
+};
+/*}}}*/
+struct worker_start {/*{{{*/
+  struct pool *pool;
+  int self;
+};
+/*}}}*/
+
+/* Which member of which pool the current thread is. */
+static __thread struct pool *my_pool = NULL;
+static __thread int my_index = 0;
+
+/* ============================================================================ */
+
+static void push_task(struct deque *dq, const struct task *t)/*{{{*/
+{
+  pthread_mutex_lock(&dq->lock);
+  if (dq->n == dq->size) {
+    struct task *nt;
+    int i;
+    nt = new_array(struct task, 2 * dq->size);
+    for (i=0; i<dq->n; i++) {
+      nt[i] = dq->tasks[(dq->head + i) % dq->size];
+    }
+    free(dq->tasks);
+    dq->tasks = nt;
+    dq->head = 0;
+    dq->size *= 2;
+  }
+  dq->tasks[(dq->head + dq->n) % dq->size] = *t;
+  dq->n++;
+  pthread_mutex_unlock(&dq->lock);
+}
+/*}}}*/
+static int pop_bottom(struct deque *dq, struct task *t)/*{{{*/
+{
+  int result = 0;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->n > 0) {
+    dq->n--;
+    *t = dq->tasks[(dq->head + dq->n) % dq->size];
+    result = 1;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return result;
+}
+/*}}}*/
+static int steal_top(struct deque *dq, struct task *t)/*{{{*/
+{
+  int result = 0;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->n > 0) {
+    *t = dq->tasks[dq->head];
+    dq->head = (dq->head + 1) % dq->size;
+    dq->n--;
+    result = 1;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return result;
+}
+/*}}}*/
+static int get_task(struct pool *p, int self, struct task *t)/*{{{*/
+{
+  int i;
+  if (__atomic_load_n(&p->n_queued, __ATOMIC_ACQUIRE) == 0) {
+    return 0;
+  }
+  if (pop_bottom(p->deques + self, t)) {
+    goto got_one;
+  }
+  for (i=1; i<p->n_threads; i++) {
+    int victim = (self + i) % p->n_threads;
+    if (steal_top(p->deques + victim, t)) {
+      goto got_one;
+    }
+  }
+  return 0;
+
+got_one:
+  __atomic_sub_fetch(&p->n_queued, 1, __ATOMIC_ACQ_REL);
+  return 1;
+}
+/*}}}*/
+static void run_task(struct pool *p, struct task *t)/*{{{*/
+{
+  (t->fn)(t->arg);
+  if (__atomic_sub_fetch(&t->group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    /* The group may belong to someone asleep in pool_wait().  It mustn't be
+     * touched after this, since the waiter can return and free it. */
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->progress);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+/*}}}*/
+static void *worker_main(void *arg)/*{{{*/
+{
+  struct worker_start *start = (struct worker_start *) arg;
+  struct pool *p = start->pool;
+  int self = start->self;
+  struct task t;
+
+  free(start);
+  my_pool = p;
+  my_index = self;
+
+  while (1) {
+    if (get_task(p, self, &t)) {
+      run_task(p, &t);
+      continue;
+    }
+    pthread_mutex_lock(&p->lock);
+    while (!p->shutdown && (__atomic_load_n(&p->n_queued, __ATOMIC_ACQUIRE) == 0)) {
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+    if (p->shutdown && (__atomic_load_n(&p->n_queued, __ATOMIC_ACQUIRE) == 0)) {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+  return NULL;
+}
+/*}}}*/
+
+/* ============================================================================ */
+
+struct pool *pool_create(int n_threads)/*{{{*/
+{
+  struct pool *p;
+  int i;
+
+  if (n_threads < 1) n_threads = 1;
+  p = new(struct pool);
+  p->n_threads = n_threads;
+  p->threads = new_array(pthread_t, n_threads);
+  p->deques = new_array(struct deque, n_threads);
+  for (i=0; i<n_threads; i++) {
+    struct deque *dq = p->deques + i;
+    pthread_mutex_init(&dq->lock, NULL);
+    dq->size = 64;
+    dq->tasks = new_array(struct task, dq->size);
+    dq->head = 0;
+    dq->n = 0;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  pthread_cond_init(&p->progress, NULL);
+  p->n_queued = 0;
+  p->shutdown = 0;
+
+  my_pool = p;
+  my_index = 0;
+  for (i=1; i<n_threads; i++) {
+    struct worker_start *start = new(struct worker_start);
+    start->pool = p;
+    start->self = i;
+    if (pthread_create(p->threads + i, NULL, worker_main, start)) {
+      fprintf(stderr, "Could not create thread %d\n", i);
+      exit(1);
+    }
+  }
+  return p;
+}
+/*}}}*/
+void pool_submit(struct pool *p, struct task_group *group, TASK_FN fn, void *arg)/*{{{*/
+{
+  struct task t;
+  int self;
+
+  t.fn = fn;
+  t.arg = arg;
+  t.group = group;
+  __atomic_add_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+
+  if (p->n_threads == 1) {
+    /* Nobody else to hand it to. */
+    run_task(p, &t);
+    return;
+  }
+
+  self = (my_pool == p) ? my_index : 0;
+  push_task(p->deques + self, &t);
+  __atomic_add_fetch(&p->n_queued, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_signal(&p->wake);
+  pthread_cond_broadcast(&p->progress);
+  pthread_mutex_unlock(&p->lock);
+}
+/*}}}*/
+void pool_wait(struct pool *p, struct task_group *group)/*{{{*/
+{
+  /* Rather than just blocking, the waiting thread runs queued tasks (its own
+   * first) until everything in the group has finished.  This keeps nested
+   * parallelism from deadlocking.  When there is nothing to run, it sleeps
+   * until a task is queued or the group's last task finishes. */
+  int self = (my_pool == p) ? my_index : 0;
+  struct task t;
+
+  while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+    if (get_task(p, self, &t)) {
+      run_task(p, &t);
+      continue;
+    }
+    pthread_mutex_lock(&p->lock);
+    while ((__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) &&
+           (__atomic_load_n(&p->n_queued, __ATOMIC_ACQUIRE) == 0)) {
+      pthread_cond_wait(&p->progress, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+/*}}}*/
+int pool_size(const struct pool *p)/*{{{*/
+{
+  return p->n_threads;
+}
+/*}}}*/
+void pool_destroy(struct pool *p)/*{{{*/
+{
+  int i;
+
+  pthread_mutex_lock(&p->lock);
+  p->shutdown = 1;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  for (i=1; i<p->n_threads; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  for (i=0; i<p->n_threads; i++) {
+    pthread_mutex_destroy(&p->deques[i].lock);
+    free(p->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  pthread_cond_destroy(&p->progress);
+  free(p->deques);
+  free(p->threads);
+  if (my_pool == p) my_pool = NULL;
+  free(p);
+}
+/*}}}*/
@@ -17,6 +17,8 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
  */
 
+#include <ctype.h>
+
 #include "sku.h"
 
 static void chomp(char *x)/*{{{*/
@@ -28,22 +30,39 @@ static void chomp(char *x)/*{{{*/
   }
 }
 /*}}}*/
-void read_grid(struct layout **lay, int **state, int options)/*{{{*/
+static int blank_line_p(const char *x)/*{{{*/
 {
+  while (*x) {
+    if (!isspace((unsigned char) *x)) return 0;
+    x++;
+  }
+  return 1;
+}
+/*}}}*/
+int read_next_grid(struct layout **lay, int **state, int options)/*{{{*/
+{
+  /* Returns 0 if the input is exhausted before another '#layout: ' header is
+   * found, READ_NO_HEADER or READ_SHORT if what follows isn't a whole grid
+   * (for report_read_error() to say so), otherwise 1.  Blank lines between
+   * grids are skipped, so the output of one batch run can be fed straight into
+   * another. */
   int rmap[256];
   int valid[256];
   int i, c;
   char buffer[256];
   struct layout *my_lay;
 
-  fgets(buffer, sizeof(buffer), stdin);
+  do {
+    if (!fgets(buffer, sizeof(buffer), stdin)) {
+      return 0;
+    }
+  } while (blank_line_p(buffer));
   chomp(buffer);
   if (strncmp(buffer, "#layout: ", 9)) {
-    fprintf(stderr, "Input does not start with '#layout: ', giving up.\n");
-    exit(1);
+    return READ_NO_HEADER;
   }
 
-  my_lay = genlayout(buffer + 9, options);
+  my_lay = find_layout(buffer + 9, options);
   *state = new_array(int, my_lay->nc);
   
 
@@ -65,8 +84,8 @@ void read_grid(struct layout **lay, int **state, int options)/*{{{*/
     do {
       c = getchar();
       if (c == EOF) {
-        fprintf(stderr, "Ran out of input data!\n");
-        exit(1);
+        free(*state);
+        return READ_SHORT;
       }
       if (valid[c]) {
         (*state)[i] = rmap[c];
@@ -74,5 +93,24 @@ void read_grid(struct layout **lay, int **state, int options)/*{{{*/
     } while (!valid[c]);
   }
   *lay = my_lay;
+  return 1;
+}
+/*}}}*/
+void report_read_error(int status)/*{{{*/
+{
+  if (status == READ_SHORT) {
+    fprintf(stderr, "Ran out of input data!\n");
+  } else {
+    fprintf(stderr, "Input does not start with '#layout: ', giving up.\n");
+  }
+  exit(1);
+}
+/*}}}*/
+void read_grid(struct layout **lay, int **state, int options)/*{{{*/
+{
+  int status = read_next_grid(lay, state, options);
+  if (status <= 0) {
+    report_read_error(status ? status : READ_NO_HEADER);
+  }
 }
 /*}}}*/
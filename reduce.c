@@ -18,6 +18,7 @@
  */
 
 #include "sku.h"
+#include <pthread.h>
 
 static void inner_reduce_symmetrify_blanks(struct layout *lay, int *state, int options)/*{{{*/
 {
@@ -32,16 +33,42 @@ static void inner_reduce_symmetrify_blanks(struct layout *lay, int *state, int o
   }
 }
 /*}}}*/
+/* Search limit for the exact cover solver in count_solutions(). */
+#define DLX_NODES_PER_CELL 16
+
+static int count_solutions(struct context *ctx, struct layout *lay, int *copy,
+    const struct constraint *simplify_cons, int options)/*{{{*/
+{
+  /* Solve 'copy' for the uniqueness checks.  Only whether the answer is 0, 1
+   * or more matters.  With -s and -X, the exact cover solver has a go first.
+   * It is quick to find a second solution, but can be slow to prove there
+   * isn't one on big sparse grids, so it only gets a limited number of nodes
+   * before the rules and speculation take over.  (Without -s the rules alone
+   * have to solve the grid, and failing to do that is cheap anyway.)  Plain
+   * 9x9 grids are left to infer(), which hands them to bb9.c. */
+  if (((options & (OPT_DLX | OPT_SPECULATE)) == (OPT_DLX | OPT_SPECULATE)) &&
+      !lay->is_plain_9x9) {
+    int *scratch = new_array(int, lay->nc);
+    int n_sol;
+    memcpy(scratch, copy, lay->nc * sizeof(int));
+    n_sol = dlx_solve(lay, scratch, 2, DLX_NODES_PER_CELL * lay->nc);
+    free(scratch);
+    if (n_sol >= 0) {
+      return n_sol;
+    }
+  }
+  return infer(ctx, lay, copy, NULL, NULL, NULL, simplify_cons, OPT_STOP_ON_2 | (options & OPT_SPECULATE));
+}
+/*}}}*/
 /*{{{ inner_reduce_check_solvable() */
-static int inner_reduce_check_solvable(struct layout *lay,
+static int inner_reduce_check_solvable(struct context *ctx, struct layout *lay,
     int *state, const struct constraint *simplify_cons, int options)
 {
   int *copy;
   int n_solutions, result;
   copy = new_array(int, lay->nc);
   memcpy(copy, state, lay->nc * sizeof(int));
-  setup_terminals(lay);
-  n_solutions = infer(lay, copy, NULL, NULL, simplify_cons, OPT_STOP_ON_2 | (options & OPT_SPECULATE));
+  n_solutions = count_solutions(ctx, lay, copy, simplify_cons, options);
   if (n_solutions == 1) {
     result = 1;
   } else {
@@ -77,7 +104,7 @@ static int trivial_p(struct layout *lay, int *state)/*{{{*/
 }
 /*}}}*/
 /*{{{ puzzle_meets_requirements_p() */
-static int puzzle_meets_requirements_p(struct layout *lay, int *state,
+static int puzzle_meets_requirements_p(struct context *ctx, struct layout *lay, int *state,
     const struct constraint *simplify_cons,
     const struct constraint *required_cons,
     int options)
@@ -94,7 +121,7 @@ static int puzzle_meets_requirements_p(struct layout *lay, int *state,
     temp_cons = *simplify_cons;
     temp_cons.do_subsets = 0;
     memcpy(copy, state, lay->nc * sizeof(int));
-    n_sol = infer(lay, copy, NULL, NULL, &temp_cons, options);
+    n_sol = infer(ctx, lay, copy, NULL, NULL, NULL, &temp_cons, options);
     if (n_sol == 1) {
       result = 0;
       goto get_out;
@@ -105,7 +132,7 @@ static int puzzle_meets_requirements_p(struct layout *lay, int *state,
     temp_cons = *simplify_cons;
     temp_cons.do_onlyopt = 0;
     memcpy(copy, state, lay->nc * sizeof(int));
-    n_sol = infer(lay, copy, NULL, NULL, &temp_cons, options);
+    n_sol = infer(ctx, lay, copy, NULL, NULL, NULL, &temp_cons, options);
     if (n_sol == 1) {
       result = 0;
       goto get_out;
@@ -116,7 +143,7 @@ static int puzzle_meets_requirements_p(struct layout *lay, int *state,
     temp_cons = *simplify_cons;
     temp_cons.do_lines = 0;
     memcpy(copy, state, lay->nc * sizeof(int));
-    n_sol = infer(lay, copy, NULL, NULL, &temp_cons, options);
+    n_sol = infer(ctx, lay, copy, NULL, NULL, NULL, &temp_cons, options);
     if (n_sol == 1) {
       result = 0;
       goto get_out;
@@ -128,7 +155,7 @@ static int puzzle_meets_requirements_p(struct layout *lay, int *state,
     temp_cons.max_partition_size = 
       (required_cons->max_partition_size == 2) ? 0 : (required_cons->max_partition_size - 1);
     memcpy(copy, state, lay->nc * sizeof(int));
-    n_sol = infer(lay, copy, NULL, NULL, &temp_cons, options);
+    n_sol = infer(ctx, lay, copy, NULL, NULL, NULL, &temp_cons, options);
     if (n_sol == 1) {
       result = 0;
       goto get_out;
@@ -143,10 +170,132 @@ get_out:
 }
 /*}}}*/
 
-int inner_reduce(struct layout *lay, int *state, const struct constraint *simplify_cons, int options)/*{{{*/
+/* ============================================================================ */
+
+/* Testing whether givens can be removed.  Each pass of inner_reduce() works
+ * through the remaining givens in a random order and commits the first one
+ * whose removal leaves a unique solution.  With a thread pool, a batch of
+ * candidates is tested at once; the earliest success in the batch wins and the
+ * tests after it are abandoned.  Each test has its own random stream (derived
+ * from one drawn per pass), so the outcome is the same as testing the
+ * candidates one at a time. */
+
+struct removal_batch {/*{{{*/
+  struct layout *lay;
+  const int *answer;
+  const struct constraint *simplify_cons;
+  int options;
+  long pass_seed;
+
+  pthread_mutex_t lock;
+  int n;
+  struct removal_test *tests;
+  int first_ok;         /* position in tests[] of the earliest success, or n */
+};
+/*}}}*/
+struct removal_test {/*{{{*/
+  struct removal_batch *batch;
+  int index;            /* position in the pass */
+  int ii;               /* the given to remove, with its symmetry ring */
+  int ok;
+  int abandon;
+  struct context ctx;   /* kept from one test to the next, for its buffers */
+};
+/*}}}*/
+static int test_removal(struct removal_batch *b, struct context *ctx, int ii, int index, int *abandon)/*{{{*/
+{
+  /* Whether the puzzle still has a unique solution with the given at 'ii' and
+   * its symmetry ring removed. */
+  struct layout *lay = b->lay;
+  int *copy;
+  int j;
+  int n_sol;
+
+  seed_context(ctx, derive_seed(b->pass_seed, index));
+  ctx->abandon = abandon;
+  copy = new_array(int, lay->nc);
+  memcpy(copy, b->answer, lay->nc * sizeof(int));
+  copy[ii] = -1;
+  for (j = SYM(ii); j != ii; j = SYM(j)) {
+    copy[j] = -1;
+  }
+
+  n_sol = count_solutions(ctx, lay, copy, b->simplify_cons, b->options);
+  free(copy);
+  return (n_sol == 1);
+}
+/*}}}*/
+static void run_removal_test(void *arg)/*{{{*/
+{
+  struct removal_test *t = (struct removal_test *) arg;
+  struct removal_batch *b = t->batch;
+  int pos = t - b->tests;
+  int i;
+
+  t->ok = 0;
+  if (__atomic_load_n(&t->abandon, __ATOMIC_RELAXED)) return;
+  if (!test_removal(b, &t->ctx, t->ii, t->index, &t->abandon)) return;
+  if (__atomic_load_n(&t->abandon, __ATOMIC_RELAXED)) return;
+
+  t->ok = 1;
+  pthread_mutex_lock(&b->lock);
+  if (pos < b->first_ok) {
+    b->first_ok = pos;
+    /* Nothing later in the batch can matter now. */
+    for (i = pos + 1; i < b->n; i++) {
+      __atomic_store_n(&b->tests[i].abandon, 1, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&b->lock);
+}
+/*}}}*/
+static int run_removal_batch(struct context *ctx, struct removal_batch *b)/*{{{*/
+{
+  /* Returns the position in the batch of the first removable given, or b->n if
+   * there isn't one. */
+  struct task_group group;
+  int i;
+
+  b->first_ok = b->n;
+  group.pending = 0;
+  for (i=0; i<b->n; i++) {
+    b->tests[i].batch = b;
+    b->tests[i].ok = 0;
+    b->tests[i].abandon = 0;
+    pool_submit(ctx->pool, &group, run_removal_test, b->tests + i);
+  }
+  pool_wait(ctx->pool, &group);
+  return b->first_ok;
+}
+/*}}}*/
+static void keep_given(struct layout *lay, int *keep, int ii, int *tally, int *kept_givens, int options)/*{{{*/
+{
+  /* If it's no good removing this given now, it won't be any better to try
+   * removing it again later... */
+  int j;
+  if (options & OPT_VERBOSE) {
+    fprintf(stderr, "%4d :  (can't remove given from <%s>)\n", *tally, lay->cells[ii].name);
+  }
+  keep[ii] = 1;
+  ++*kept_givens;
+  for (j = SYM(ii); j != ii; j = SYM(j)) {
+    keep[j] = 1;
+    ++*kept_givens;
+    if (options & OPT_VERBOSE) {
+      fprintf(stderr, "%4d :  (can't remove given from <%s> (sym))\n", *tally, lay->cells[j].name);
+    }
+    --*tally;
+  }
+}
+/*}}}*/
+
+int inner_reduce(struct context *ctx, struct layout *lay, int *state, const struct constraint *simplify_cons, int options)/*{{{*/
 {
-  int *copy, *answer;
+  int *answer;
   int *keep;
+  int *candidates, *seen;
+  struct removal_batch batch;
+  int batch_size;
   int i;
   int ok;
   int tally;
@@ -154,13 +303,29 @@ int inner_reduce(struct layout *lay, int *state, const struct constraint *simpli
   int is_trivial;
 
   inner_reduce_symmetrify_blanks(lay, state, options);
-  if (!inner_reduce_check_solvable(lay, state, simplify_cons, options)) {
+  if (!inner_reduce_check_solvable(ctx, lay, state, simplify_cons, options)) {
     fprintf(stderr, "Cannot reduce the puzzle, it doesn't have a unique solution\n");
   }
 
-  copy = new_array(int, lay->nc);
   answer = new_array(int, lay->nc);
   keep = new_array(int, lay->nc);
+  candidates = new_array(int, lay->nc);
+  seen = new_array(int, lay->nc);
+
+  batch.lay = lay;
+  batch.answer = answer;
+  batch.simplify_cons = simplify_cons;
+  batch.options = options;
+  pthread_mutex_init(&batch.lock, NULL);
+  if (ctx->pool && (pool_size(ctx->pool) > 1)) {
+    batch_size = 2 * pool_size(ctx->pool);
+  } else {
+    batch_size = 1;
+  }
+  batch.tests = new_array(struct removal_test, batch_size);
+  for (i=0; i<batch_size; i++) {
+    init_context(&batch.tests[i].ctx, 0);
+  }
 
   do {
   
@@ -176,52 +341,49 @@ int inner_reduce(struct layout *lay, int *state, const struct constraint *simpli
 
     do {
       int start_point;
-      int j;
-      start_point = lrand48() % lay->nc;
+      int n_candidates;
+      int j, k;
+      start_point = ctx_random(ctx) % lay->nc;
+      batch.pass_seed = ctx_random(ctx);
       ok = -1;
+
+      /* Givens in the same symmetry ring are removed together, so only the
+       * first of each ring needs testing. */
+      memset(seen, 0, lay->nc * sizeof(int));
+      n_candidates = 0;
       for (i=0; i<lay->nc; i++) {
         int ii;
-        int n_sol;
-
         ii = (i + start_point) % lay->nc;
         if (answer[ii] < 0) continue;
         if (keep[ii] == 1) continue;
-
-        memcpy(copy, answer, lay->nc * sizeof(int));
-
-        /* Remove given from 'ii' and all its symmetry group. */
-        copy[ii] = -1;
+        if (seen[ii]) continue;
+        seen[ii] = 1;
         for (j = SYM(ii); j != ii; j = SYM(j)) {
-          copy[j] = -1;
+          seen[j] = 1;
         }
+        candidates[n_candidates++] = ii;
+      }
 
-        if (options & OPT_SPECULATE) {
-          setup_terminals(lay);
-          n_sol = infer(lay, copy, NULL, NULL, simplify_cons, OPT_SPECULATE);
-        } else {
-          setup_terminals(lay);
-          n_sol = infer(lay, copy, NULL, NULL, simplify_cons, OPT_STOP_ON_2);
+      for (i=0; (ok < 0) && (i < n_candidates); i += batch.n) {
+        int first_ok;
+        batch.n = (n_candidates - i < batch_size) ? (n_candidates - i) : batch_size;
+        for (k=0; k<batch.n; k++) {
+          batch.tests[k].index = i + k;
+          batch.tests[k].ii = candidates[i + k];
         }
-        tally--;
-        if (n_sol == 1) {
-          ok = ii;
-          break;
+        if (batch_size > 1) {
+          first_ok = run_removal_batch(ctx, &batch);
         } else {
-          /* If it's no good removing this given now, it won't be any better to try
-           * removing it again later... */
-          if (options & OPT_VERBOSE) {
-            fprintf(stderr, "%4d :  (can't remove given from <%s>)\n", tally, lay->cells[ii].name);
-          }
-          keep[ii] = 1;
-          ++kept_givens;
-          for (j = SYM(ii); j != ii; j = SYM(j)) {
-            keep[j] = 1;
-            ++kept_givens;
-            if (options & OPT_VERBOSE) {
-              fprintf(stderr, "%4d :  (can't remove given from <%s> (sym))\n", tally, lay->cells[j].name);
-            }
-            tally--;
+          first_ok = test_removal(&batch, &batch.tests[0].ctx, candidates[i], i, NULL) ? 0 : 1;
+        }
+        for (k=0; k<batch.n; k++) {
+          int ii = batch.tests[k].ii;
+          tally--;
+          if (k == first_ok) {
+            ok = ii;
+            break;
           }
+          keep_given(lay, keep, ii, &tally, &kept_givens, options);
         }
       }
 
@@ -246,34 +408,123 @@ int inner_reduce(struct layout *lay, int *state, const struct constraint *simpli
 
   memcpy(state, answer, lay->nc * sizeof(int));
 
-  free(copy);
+  pthread_mutex_destroy(&batch.lock);
+  for (i=0; i<batch_size; i++) {
+    free_context(&batch.tests[i].ctx);
+  }
+  free(batch.tests);
   free(answer);
   free(keep);
+  free(candidates);
+  free(seen);
 
   return kept_givens;
 }
 /*}}}*/
 
-/*{{{ reduce() */
-void reduce(int iters_for_min,
-    const struct constraint *simplify_cons, const struct constraint *required_cons,
-    int options)
+/* ============================================================================ */
+
+/* Search for the reduction with the fewest kept givens (-m).  The iterations
+ * are independent, so they are run as tasks on the pool when there is one.
+ * Each iteration has its own random stream derived from a base seed, and ties
+ * go to the lowest iteration number, so the answer is the same whatever the
+ * number of threads. */
+
+struct min_search {/*{{{*/
+  struct layout *lay;
+  const int *state;
+  const struct constraint *simplify_cons;
+  int options;
+  long base_seed;
+
+  pthread_mutex_t lock;
+  int best_givens;      /* lay->nc until something has been found */
+  int best_iter;
+  int *best;
+};
+/*}}}*/
+struct min_iter {/*{{{*/
+  struct min_search *search;
+  int index;
+};
+/*}}}*/
+static void run_min_iter(void *arg)/*{{{*/
+{
+  struct min_iter *it = (struct min_iter *) arg;
+  struct min_search *s = it->search;
+  struct context ctx;
+  int *copy;
+  int kept_givens;
+  int nc = s->lay->nc;
+
+  init_context(&ctx, derive_seed(s->base_seed, it->index));
+  copy = new_array(int, nc);
+  memcpy(copy, s->state, nc * sizeof(int));
+  kept_givens = inner_reduce(&ctx, s->lay, copy, s->simplify_cons, (s->options & ~OPT_VERBOSE));
+
+  pthread_mutex_lock(&s->lock);
+  if ((kept_givens < s->best_givens) ||
+      ((kept_givens == s->best_givens) && (it->index < s->best_iter))) {
+    if ((s->options & OPT_VERBOSE) && (kept_givens < s->best_givens)) {
+      fprintf(stderr, "Found a layout with %d givens\n", kept_givens);
+      display(stderr, s->lay, copy);
+    }
+    s->best_givens = kept_givens;
+    s->best_iter = it->index;
+    memcpy(s->best, copy, nc * sizeof(int));
+  }
+  pthread_mutex_unlock(&s->lock);
+  free(copy);
+  free_context(&ctx);
+}
+/*}}}*/
+static void reduce_to_min(struct context *ctx, struct layout *lay, int *state, int *result,
+    const struct constraint *simplify_cons, int iters_for_min, int options)/*{{{*/
+{
+  struct min_search search;
+  struct min_iter *iters;
+  struct task_group group;
+  int i;
+
+  search.lay = lay;
+  search.state = state;
+  search.simplify_cons = simplify_cons;
+  search.options = options;
+  search.base_seed = ctx_random(ctx);
+  pthread_mutex_init(&search.lock, NULL);
+  search.best_givens = lay->nc;
+  search.best_iter = iters_for_min;
+  search.best = result;
+
+  iters = new_array(struct min_iter, iters_for_min);
+  group.pending = 0;
+  for (i=0; i<iters_for_min; i++) {
+    iters[i].search = &search;
+    iters[i].index = i;
+    if (ctx->pool) {
+      pool_submit(ctx->pool, &group, run_min_iter, iters + i);
+    } else {
+      run_min_iter(iters + i);
+    }
+  }
+  if (ctx->pool) {
+    pool_wait(ctx->pool, &group);
+  }
+
+  free(iters);
+  pthread_mutex_destroy(&search.lock);
+}
+/*}}}*/
+
+static void reduce_grid(struct context *ctx, struct layout *lay, int *state, const struct op_args *args)/*{{{*/
 {
-  int *state;
+  const struct constraint *simplify_cons = args->simplify_cons;
+  const struct constraint *required_cons = args->required_cons;
+  int iters_for_min = args->iters_for_min;
+  int options = args->options;
   int *result;
   int kept_givens = 0;
-  struct layout *lay;
 
-  /* Sanity checks. */
-  if ((required_cons->max_partition_size > simplify_cons->max_partition_size) ||
-      (required_cons->do_subsets && !simplify_cons->do_subsets) ||
-      (required_cons->do_onlyopt && !simplify_cons->do_onlyopt) ||
-      (required_cons->do_lines && !simplify_cons->do_lines)) {
-    fprintf(stderr, "-E options remove rules required by -R options\nGiving up\n");
-    exit(1);
-  }
-    
-  read_grid(&lay, &state, options);
   result = new_array(int, lay->nc);
 
   if (!required_cons->is_default) {
@@ -285,50 +536,48 @@ void reduce(int iters_for_min,
     copy2 = new_array(int, lay->nc);
     do {
       memcpy(copy, state, lay->nc * sizeof(int));
-      kept_givens = inner_reduce(lay, copy, simplify_cons, (options & ~OPT_VERBOSE));
+      kept_givens = inner_reduce(ctx, lay, copy, simplify_cons, (options & ~OPT_VERBOSE));
       found = 0;
       memcpy(copy2, copy, lay->nc * sizeof(int));
 
-      if (puzzle_meets_requirements_p(lay, copy2, simplify_cons, required_cons, options & ~OPT_VERBOSE)) {
+      if (puzzle_meets_requirements_p(ctx, lay, copy2, simplify_cons, required_cons, options & ~OPT_VERBOSE)) {
         found = 1;
       }
     } while (!found);
-    display(stdout, lay, copy);
+    display(ctx->out, lay, copy);
     free(copy2);
     free(copy);
   } else if (iters_for_min == 0) {
-    kept_givens = inner_reduce(lay, state, simplify_cons, options);
+    kept_givens = inner_reduce(ctx, lay, state, simplify_cons, options);
 
     if (options & OPT_VERBOSE) {
       fprintf(stderr, "%d givens kept\n", kept_givens);
     }
-    display(stdout, lay, state);
+    display(ctx->out, lay, state);
   } else {
-    int i;
-    int min_givens;
-    int *copy;
-    min_givens = lay->nc;
-    copy = new_array(int, lay->nc);
-    for (i=0; i<iters_for_min; i++) {
-      memcpy(copy, state, lay->nc * sizeof(int));
-      kept_givens = inner_reduce(lay, copy, simplify_cons, (options & ~OPT_VERBOSE));
-      if (kept_givens < min_givens) {
-        min_givens = kept_givens;
-        if (options & OPT_VERBOSE) {
-          fprintf(stderr, "Found a layout with %d givens\n", kept_givens);
-          display(stderr, lay, copy);
-        }
-        /* The result always has to have the minimum number of givens found so
-         * far. */
-        memcpy(result, copy, lay->nc * sizeof(int));
-      }
-    }
-    display(stdout, lay, result);
+    reduce_to_min(ctx, lay, state, result, simplify_cons, iters_for_min, options);
+    display(ctx->out, lay, result);
   }
 
   free(result);
-  free(state);
-  free_layout(lay);
   return;
 }
 /*}}}*/
+/*{{{ reduce() */
+void reduce(const struct op_args *args)
+{
+  const struct constraint *simplify_cons = args->simplify_cons;
+  const struct constraint *required_cons = args->required_cons;
+
+  /* Sanity checks. */
+  if ((required_cons->max_partition_size > simplify_cons->max_partition_size) ||
+      (required_cons->do_subsets && !simplify_cons->do_subsets) ||
+      (required_cons->do_onlyopt && !simplify_cons->do_onlyopt) ||
+      (required_cons->do_lines && !simplify_cons->do_lines)) {
+    fprintf(stderr, "-E options remove rules required by -R options\nGiving up\n");
+    exit(1);
+  }
+    
+  for_each_grid(reduce_grid, args);
+}
+/*}}}*/
@@ -0,0 +1,367 @@
+/*
+ *  sku - analysis tool for Sudoku puzzles
+ *  Copyright (C) 2005  Richard P. Curnow
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/* Scans over a whole grid's candidate sets.
+ *
+ * These run over every cell of the layout, so on the big superlayouts they
+ * are worth doing several cells at a time.  There is a plain C version, and
+ * on x86 versions for CPUs with the popcnt instruction, AVX2 and AVX-512
+ * (with VPOPCNTDQ).  The best one the CPU can run is chosen the first time
+ * through, so the same binary works everywhere.  The grids small enough to
+ * be scanned mostly have 16 symbols or fewer, so there is a set of them for
+ * 16-bit candidate sets as well.
+ */
+
+#include <pthread.h>
+
+#include "sku.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/* Bigger than any count of candidates */
+#define NO_CELL 0x7fffffff
+
+typedef int (*FEWEST_FN)(const unsigned int *poss, const signed char *state, int n);
+typedef int (*FEWEST_NARROW_FN)(const unsigned short *poss, const signed char *state, int n);
+
+static int fewest_candidates_c(const unsigned int *poss, const signed char *state, int n)/*{{{*/
+{
+  int i, ic, best;
+  best = NO_CELL;
+  ic = -1;
+  for (i=0; i<n; i++) {
+    if (state[i] < 0) {
+      int nb = count_bits(poss[i]);
+      if (nb < best) {
+        best = nb;
+        ic = i;
+      }
+    }
+  }
+  return ic;
+}
+/*}}}*/
+static int fewest_candidates_narrow_c(const unsigned short *poss, const signed char *state, int n)/*{{{*/
+{
+  int i, ic, best;
+  best = NO_CELL;
+  ic = -1;
+  for (i=0; i<n; i++) {
+    if (state[i] < 0) {
+      int nb = count_bits(poss[i]);
+      if (nb < best) {
+        best = nb;
+        ic = i;
+      }
+    }
+  }
+  return ic;
+}
+/*}}}*/
+#ifdef SCAN_X86
+__attribute__((target("popcnt")))
+static int fewest_candidates_popcnt(const unsigned int *poss, const signed char *state, int n)/*{{{*/
+{
+  int i, ic, best;
+  best = NO_CELL;
+  ic = -1;
+  for (i=0; i<n; i++) {
+    if (state[i] < 0) {
+      int nb = __builtin_popcount((unsigned int) poss[i]);
+      if (nb < best) {
+        best = nb;
+        ic = i;
+      }
+    }
+  }
+  return ic;
+}
+/*}}}*/
+__attribute__((target("popcnt")))
+static int fewest_candidates_narrow_popcnt(const unsigned short *poss, const signed char *state, int n)/*{{{*/
+{
+  int i, ic, best;
+  best = NO_CELL;
+  ic = -1;
+  for (i=0; i<n; i++) {
+    if (state[i] < 0) {
+      int nb = __builtin_popcount((unsigned int) poss[i]);
+      if (nb < best) {
+        best = nb;
+        ic = i;
+      }
+    }
+  }
+  return ic;
+}
+/*}}}*/
+__attribute__((target("avx2")))
+static int fewest_candidates_avx2(const unsigned int *poss, const signed char *state, int n)/*{{{*/
+{
+  /* Each lane keeps the first cell it has seen with its lowest count.  No
+   * vector popcount in AVX2, so count the nibbles with a lookup table. */
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i ones8 = _mm256_set1_epi8(1);
+  const __m256i ones16 = _mm256_set1_epi16(1);
+  const __m256i none = _mm256_set1_epi32(NO_CELL);
+  __m256i best = none;
+  __m256i best_ic = _mm256_set1_epi32(-1);
+  __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i step = _mm256_set1_epi32(8);
+  int lane_best[8], lane_ic[8];
+  int i, k, ic, min;
+
+  for (i=0; i+8<=n; i+=8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *) (poss + i));
+    __m256i s = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (state + i)));
+    __m256i lo = _mm256_and_si256(p, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi32(p, 4), nibble);
+    __m256i c8 = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+    __m256i nb = _mm256_madd_epi16(_mm256_maddubs_epi16(c8, ones8), ones16);
+    __m256i open = _mm256_srai_epi32(s, 31);
+    __m256i less;
+    nb = _mm256_blendv_epi8(none, nb, open);
+    less = _mm256_cmpgt_epi32(best, nb);
+    best = _mm256_blendv_epi8(best, nb, less);
+    best_ic = _mm256_blendv_epi8(best_ic, idx, less);
+    idx = _mm256_add_epi32(idx, step);
+  }
+  _mm256_storeu_si256((__m256i *) lane_best, best);
+  _mm256_storeu_si256((__m256i *) lane_ic, best_ic);
+  min = NO_CELL;
+  ic = -1;
+  for (k=0; k<8; k++) {
+    if ((lane_best[k] < min) || ((lane_best[k] == min) && (lane_ic[k] < ic))) {
+      min = lane_best[k];
+      ic = lane_ic[k];
+    }
+  }
+  for (; i<n; i++) {
+    if (state[i] < 0) {
+      int nb = count_bits(poss[i]);
+      if (nb < min) {
+        min = nb;
+        ic = i;
+      }
+    }
+  }
+  return ic;
+}
+/*}}}*/
+__attribute__((target("avx2")))
+static int fewest_candidates_narrow_avx2(const unsigned short *poss, const signed char *state, int n)/*{{{*/
+{
+  /* The same in sixteen 16-bit lanes, which hold the cell numbers too.  A
+   * lane whose cell number is still -1 has not seen an open cell. */
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i ones8 = _mm256_set1_epi8(1);
+  const __m256i none = _mm256_set1_epi16(0x7fff);
+  __m256i best = none;
+  __m256i best_ic = _mm256_set1_epi16(-1);
+  __m256i idx = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m256i step = _mm256_set1_epi16(16);
+  short lane_best[16], lane_ic[16];
+  int i, k, ic, min;
+
+  for (i=0; i+16<=n; i+=16) {
+    __m256i p = _mm256_loadu_si256((const __m256i *) (poss + i));
+    __m256i s = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (state + i)));
+    __m256i lo = _mm256_and_si256(p, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(p, 4), nibble);
+    __m256i c8 = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+    __m256i nb = _mm256_maddubs_epi16(c8, ones8);
+    __m256i open = _mm256_srai_epi16(s, 15);
+    __m256i less;
+    nb = _mm256_blendv_epi8(none, nb, open);
+    less = _mm256_cmpgt_epi16(best, nb);
+    best = _mm256_blendv_epi8(best, nb, less);
+    best_ic = _mm256_blendv_epi8(best_ic, idx, less);
+    idx = _mm256_add_epi16(idx, step);
+  }
+  _mm256_storeu_si256((__m256i *) lane_best, best);
+  _mm256_storeu_si256((__m256i *) lane_ic, best_ic);
+  min = NO_CELL;
+  ic = -1;
+  for (k=0; k<16; k++) {
+    if (lane_ic[k] < 0) continue;
+    if ((lane_best[k] < min) || ((lane_best[k] == min) && (lane_ic[k] < ic))) {
+      min = lane_best[k];
+      ic = lane_ic[k];
+    }
+  }
+  for (; i<n; i++) {
+    if (state[i] < 0) {
+      int nb = count_bits(poss[i]);
+      if (nb < min) {
+        min = nb;
+        ic = i;
+      }
+    }
+  }
+  return ic;
+}
+/*}}}*/
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static int fewest_candidates_avx512(const unsigned int *poss, const signed char *state, int n)/*{{{*/
+{
+  const __m512i none = _mm512_set1_epi32(NO_CELL);
+  const __m512i zero = _mm512_setzero_si512();
+  __m512i best = none;
+  __m512i best_ic = _mm512_set1_epi32(-1);
+  __m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m512i step = _mm512_set1_epi32(16);
+  __mmask16 at_min;
+  int i, ic, min;
+
+  for (i=0; i+16<=n; i+=16) {
+    __m512i p = _mm512_loadu_si512((const void *) (poss + i));
+    __m512i s = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *) (state + i)));
+    __mmask16 open = _mm512_cmplt_epi32_mask(s, zero);
+    __m512i nb = _mm512_mask_mov_epi32(none, open, _mm512_popcnt_epi32(p));
+    __mmask16 less = _mm512_cmplt_epi32_mask(nb, best);
+    best = _mm512_mask_mov_epi32(best, less, nb);
+    best_ic = _mm512_mask_mov_epi32(best_ic, less, idx);
+    idx = _mm512_add_epi32(idx, step);
+  }
+  min = _mm512_reduce_min_epi32(best);
+  ic = -1;
+  if (min < NO_CELL) {
+    at_min = _mm512_cmpeq_epi32_mask(best, _mm512_set1_epi32(min));
+    ic = _mm512_mask_reduce_min_epi32(at_min, best_ic);
+  }
+  for (; i<n; i++) {
+    if (state[i] < 0) {
+      int nb = __builtin_popcount((unsigned int) poss[i]);
+      if (nb < min) {
+        min = nb;
+        ic = i;
+      }
+    }
+  }
+  return ic;
+}
+/*}}}*/
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static int fewest_candidates_narrow_avx512(const unsigned short *poss, const signed char *state, int n)/*{{{*/
+{
+  /* Widen the sets to 32 bits on the way in; otherwise as above. */
+  const __m512i none = _mm512_set1_epi32(NO_CELL);
+  const __m512i zero = _mm512_setzero_si512();
+  __m512i best = none;
+  __m512i best_ic = _mm512_set1_epi32(-1);
+  __m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m512i step = _mm512_set1_epi32(16);
+  __mmask16 at_min;
+  int i, ic, min;
+
+  for (i=0; i+16<=n; i+=16) {
+    __m512i p = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *) (poss + i)));
+    __m512i s = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *) (state + i)));
+    __mmask16 open = _mm512_cmplt_epi32_mask(s, zero);
+    __m512i nb = _mm512_mask_mov_epi32(none, open, _mm512_popcnt_epi32(p));
+    __mmask16 less = _mm512_cmplt_epi32_mask(nb, best);
+    best = _mm512_mask_mov_epi32(best, less, nb);
+    best_ic = _mm512_mask_mov_epi32(best_ic, less, idx);
+    idx = _mm512_add_epi32(idx, step);
+  }
+  min = _mm512_reduce_min_epi32(best);
+  ic = -1;
+  if (min < NO_CELL) {
+    at_min = _mm512_cmpeq_epi32_mask(best, _mm512_set1_epi32(min));
+    ic = _mm512_mask_reduce_min_epi32(at_min, best_ic);
+  }
+  for (; i<n; i++) {
+    if (state[i] < 0) {
+      int nb = __builtin_popcount((unsigned int) poss[i]);
+      if (nb < min) {
+        min = nb;
+        ic = i;
+      }
+    }
+  }
+  return ic;
+}
+/*}}}*/
+#endif
+
+static FEWEST_FN fewest_fn;
+static FEWEST_NARROW_FN fewest_narrow_fn;
+static pthread_once_t choose_once = PTHREAD_ONCE_INIT;
+
+static void choose_kernels(void)/*{{{*/
+{
+  fewest_fn = fewest_candidates_c;
+  fewest_narrow_fn = fewest_candidates_narrow_c;
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+    fewest_fn = fewest_candidates_avx512;
+    fewest_narrow_fn = fewest_candidates_narrow_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    fewest_fn = fewest_candidates_avx2;
+    fewest_narrow_fn = fewest_candidates_narrow_avx2;
+  } else if (__builtin_cpu_supports("popcnt")) {
+    fewest_fn = fewest_candidates_popcnt;
+    fewest_narrow_fn = fewest_candidates_narrow_popcnt;
+  }
+#endif
+}
+/*}}}*/
+int fewest_candidates(const unsigned int *poss, const signed char *state, int n)/*{{{*/
+{
+  /* The first open cell (state < 0) that has the fewest candidates left, or -1
+   * if there are no open cells. */
+  pthread_once(&choose_once, choose_kernels);
+  return fewest_fn(poss, state, n);
+}
+/*}}}*/
+int fewest_candidates_narrow(const unsigned short *poss, const signed char *state, int n)/*{{{*/
+{
+  /* The same for 16-bit candidate sets. */
+  pthread_once(&choose_once, choose_kernels);
+  return fewest_narrow_fn(poss, state, n);
+}
+/*}}}*/
+int fewest_candidates_wide(const unsigned long long *poss, const signed char *state, int n)/*{{{*/
+{
+  /* The same for 64-bit candidate sets.  Grids that need them are big enough
+   * for infer.c to keep its cells filed by count instead, so a plain loop
+   * will do. */
+  int i, ic, best;
+  best = NO_CELL;
+  ic = -1;
+  for (i=0; i<n; i++) {
+    if (state[i] < 0) {
+      int nb = count_bits64(poss[i]);
+      if (nb < best) {
+        best = nb;
+        ic = i;
+      }
+    }
+  }
+  return ic;
+}
+/*}}}*/
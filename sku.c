@@ -29,6 +29,11 @@ static void usage(void)
   fprintf(stderr,
       "General options:\n"
       "  -v          : verbose\n"
+      "  -B          : batch mode; process every grid in the input, not just the first\n"
+      "                (applies to solving, -a, -g, -r and -k)\n"
+      "  -j<number>  : use <number> threads (with -B, grids are shared out between them,\n"
+      "                otherwise they search the speculation branches of one grid)\n"
+      "  -S<number>  : use <number> as the random seed (default: from time and pid)\n"
       "\n"
       "With no option, solve a puzzle\n"
       "  -f          : if puzzle has >1 solution, only find the first\n"
@@ -38,6 +43,9 @@ static void usage(void)
       "  -M          : find a minimal solution (for puzzles with marked cells)\n"
       "\n"
       "-b<layout>    : create a blank grid with named <layout>\n"
+      "                (@<file> for a layout described in <file>)\n"
+      "\n"
+      "-C<layout>    : write <layout> in compiled form, for '#layout: @<file>'\n"
       "\n"
       "-H            : provide a hint (show the next step in the solution of a partial grid)\n"
       "\n"
@@ -52,9 +60,14 @@ static void usage(void)
       "  -El         : don't do allocation along lines (only within blocks)\n"
       "  -Eo         : don't look for squares with only one option left\n"
       "  -Es         : don't do subset analysis\n"
+      "  -E<number>  : don't look for partitions of <number> cells or more\n"
+      "                (default: look for them up to 5 cells)\n"
+      "  -R<number>  : require a partition of <number> cells to solve the puzzle\n"
       "  -m<number>  : try <number> times to find a puzzle with a smallest number of givens\n"
+      "                (the attempts are shared out between the threads given by -j)\n"
       "  -s          : allow solutions that require speculation to solve\n"
       "  -t          : allow puzzles with < 2 unknowns in a group\n"
+      "  -X          : with -s, check uniqueness by exact cover (dancing links) first\n"
       "  -y          : require 180 degree rotational symmetry\n"
       "  -yy         : require 90,180,270 degree rotational symmetry\n"
       "  -yh         : require horizontal reflective symmetry\n"
@@ -119,14 +132,33 @@ static void apply_level(const char *level, int *options, int *reduce_req_n)/*{{{
 
 /* ============================================================================ */
 
+static int parse_partition_size(const char **p, const char *flag)/*{{{*/
+{
+  /* Read the partition size from a -E or -R argument, leaving *p after it. */
+  char *end;
+  long n;
+  n = strtol(*p, &end, 10);
+  if ((n < 2) || (n > PARTITION_SIZE_LIMIT)) {
+    fprintf(stderr, "Partition size with %s must be from 2 to %d\n", flag, PARTITION_SIZE_LIMIT);
+    exit(1);
+  }
+  *p = end;
+  return (int) n;
+}
+/*}}}*/
+
+/* ============================================================================ */
+
 int main (int argc, char **argv)/*{{{*/
 {
   int options;
-  int seed;
+  int seed = 0, seed_given = 0;
   int iters_for_min = 0;
   int grey_cells = 0;
+  int n_threads = 1;
   enum operation {
     OP_BLANK,     /* Generate a blank grid */
+    OP_COMPILE,   /* Write a layout's tables out to be mapped back in */
     OP_ANY,       /* Generate any solution to a partial grid */
     OP_REDUCE,    /* Remove givens until it's no longer possible without
                      leaving an ambiguous puzzle. */
@@ -139,6 +171,7 @@ int main (int argc, char **argv)/*{{{*/
   } operation;
   char *layout_name = NULL;
   struct constraint simplify_cons, required_cons;
+  struct op_args args;
   
   operation = OP_SOLVE;
 
@@ -154,25 +187,33 @@ int main (int argc, char **argv)/*{{{*/
       operation = OP_ANY;
     } else if (!strcmp(*argv, "-A")) {
       options |= OPT_SHOW_ALL;
+    } else if (!strcmp(*argv, "-B")) {
+      options |= OPT_BATCH;
     } else if (!strncmp(*argv, "-b", 2)) {
       operation = OP_BLANK;
       layout_name = *argv + 2;
+    } else if (!strncmp(*argv, "-C", 2)) {
+      operation = OP_COMPILE;
+      layout_name = *argv + 2;
     } else if (!strncmp(*argv, "-E", 2)) {
       if ((*argv)[2] == 0) {
         simplify_cons = cons_none;
         simplify_cons.is_default = 0;
       } else {
         const char *p = 2 + *argv;
+        int n;
         simplify_cons.is_default = 0;
         while (*p) {
           switch (*p) {
             case 'l': simplify_cons.do_lines = 0; break;
             case 'o': simplify_cons.do_onlyopt = 0; break;
             case 's': simplify_cons.do_subsets = 0; break;
-            case '2': simplify_cons.max_partition_size = 0; break;
-            case '3': simplify_cons.max_partition_size = 2; break;
-            case '4': simplify_cons.max_partition_size = 3; break;
-            case '5': simplify_cons.max_partition_size = 4; break;
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+              /* No partitions of this size or bigger */
+              n = parse_partition_size(&p, "-E");
+              simplify_cons.max_partition_size = (n > 2) ? (n - 1) : 0;
+              continue;
             default: fprintf(stderr, "Can't use %c with -E\n", *p);
               break;
           }
@@ -187,6 +228,17 @@ int main (int argc, char **argv)/*{{{*/
       operation = OP_FORMAT;
     } else if (!strcmp(*argv, "-H")) {
       operation = OP_HINT;
+    } else if (!strncmp(*argv, "-j", 2)) {
+      if (((*argv)[2] == 0) && (argc > 1)) {
+        ++argv, --argc;
+        n_threads = atoi(*argv);
+      } else {
+        n_threads = atoi(*argv + 2);
+      }
+      if (n_threads < 1) {
+        fprintf(stderr, "-j needs a positive number of threads\n");
+        exit(1);
+      }
     } else if (!strncmp(*argv, "-k", 2)) {
       operation = OP_MARK;
       if ((*argv)[2] == 0) {
@@ -218,22 +270,27 @@ int main (int argc, char **argv)/*{{{*/
             case 'l': required_cons.do_lines = 1; break;
             case 'o': required_cons.do_onlyopt = 1; break;
             case 's': required_cons.do_subsets = 1; break;
-            case '2': required_cons.max_partition_size = 2; break;
-            case '3': required_cons.max_partition_size = 3; break;
-            case '4': required_cons.max_partition_size = 4; break;
-            case '5': required_cons.max_partition_size = 5; break;
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+              required_cons.max_partition_size = parse_partition_size(&p, "-R");
+              continue;
             default: fprintf(stderr, "Can't use %c with -R\n", *p);
               break;
           }
           p++;
         }
       }
+    } else if (!strncmp(*argv, "-S", 2)) {
+      seed = atoi(*argv + 2);
+      seed_given = 1;
     } else if (!strcmp(*argv, "-s")) {
       options |= OPT_SPECULATE;
     } else if (!strcmp(*argv, "-t")) {
       options |= OPT_ALLOW_TRIVIAL;
     } else if (!strcmp(*argv, "-T")) {
       operation = OP_TIDY;
+    } else if (!strcmp(*argv, "-X")) {
+      options |= OPT_DLX;
     } else if (!strcmp(*argv, "-v")) {
       options |= OPT_VERBOSE;
     } else if (!strcmp(*argv, "-y")) {
@@ -250,23 +307,40 @@ int main (int argc, char **argv)/*{{{*/
     }
   }
   
-  seed = time(NULL) ^ getpid();
+  if (simplify_cons.is_default &&
+      (required_cons.max_partition_size > simplify_cons.max_partition_size)) {
+    /* -R asked for partitions bigger than are looked for by default */
+    simplify_cons.max_partition_size = required_cons.max_partition_size;
+  }
+
+  if (!seed_given) {
+    seed = time(NULL) ^ getpid();
+  }
   if (options & OPT_VERBOSE) {
     fprintf(stderr, "Seed=%d\n", seed);
   }
-  srand48(seed);
+
+  args.simplify_cons = &simplify_cons;
+  args.required_cons = &required_cons;
+  args.iters_for_min = iters_for_min;
+  args.grey_cells = grey_cells;
+  args.options = options;
+  args.n_threads = n_threads;
+  args.seed = seed;
+
   switch (operation) {
     case OP_SOLVE:
-      solve(&simplify_cons, options);
+      solve(&args);
       break;
     case OP_HINT:
-      solve(&simplify_cons, options | OPT_HINT | OPT_VERBOSE);
+      args.options |= OPT_HINT | OPT_VERBOSE;
+      solve(&args);
       break;
     case OP_ANY:
-      solve_any(options);
+      solve_any(&args);
       break;
     case OP_REDUCE:
-      reduce(iters_for_min, &simplify_cons, &required_cons, options);
+      reduce(&args);
       break;
     case OP_BLANK:
       {
@@ -276,11 +350,19 @@ int main (int argc, char **argv)/*{{{*/
         free_layout(lay);
         break;
       }
+    case OP_COMPILE:
+      {
+        struct layout *lay;
+        lay = genlayout(*layout_name ? layout_name : "3", options);
+        write_layout_file(stdout, lay);
+        free_layout(lay);
+        break;
+      }
     case OP_GRADE:
-      grade(options);
+      grade(&args);
       break;
     case OP_MARK:
-      mark_cells(grey_cells, &simplify_cons, options);
+      mark_cells(&args);
       break;
     case OP_FORMAT:
       format_output(options);
@@ -292,6 +374,10 @@ int main (int argc, char **argv)/*{{{*/
 #endif
       break;
   }
+  free_layout_cache();
+  if (options & OPT_VERBOSE) {
+    fprintf(stderr, "%ld allocations\n", n_allocations());
+  }
   return 0;
 }
 /*}}}*/
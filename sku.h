@@ -25,23 +25,21 @@
 #include <string.h>
 #include <unistd.h>
 
-/* To cope with interlocked puzzles where some cells may be in 8 logical groups
- * (namely, the ones in the overlapping blocks if diagonals mode is on.) */
-#define NDIM 8
+/* Candidate sets have a bit per symbol; the widest kind is 64 bits, so this is
+ * as big as a group can be (an 8x8 block). */
+#define MAX_SYMBOLS 64
 
 struct cell {/*{{{*/
+  /* Only what the output needs; what the solver looks at for each cell is in
+   * the [nc] arrays of struct layout. */
   char *name;           /* cell name for verbose + debug output. */
   int index;            /* self-index (to track reordering during geographical sort.) */
-  int is_overlap;
-  int is_terminal;      /* Hack, need to do this properly. */
   short prow, pcol;     /* coordinates for printing to text output */
   short rrow, rcol;     /* raw coordinates for printing to formatted output (SVG etc) */
-  short isym;           /* index of next cell in same symmetry group (circular ring) */
-  short group[NDIM];    /* table of groups the cell is in (-1 for unused dimensions) */
 };
 /*}}}*/
 
-#define SYM(x) (lay->cells[(x)].isym)
+#define SYM(x) (lay->isym[(x)])
 
 struct dline/*{{{*/
 {
@@ -69,9 +67,26 @@ struct layout {/*{{{*/
 
   const char *symbols;        /* [ns] table of the symbols */
   struct cell *cells;   /* [nc] table of cell definitions */
+  int *cell_group_index; /* [nc+1] where in cell_groups each cell's groups start */
+  short *cell_groups;   /* the groups each cell is in, cell by cell */
+  char *is_overlap;     /* [nc] is the cell shared between subgrids */
+  short *isym;          /* [nc] index of next cell in same symmetry group (circular ring) */
   char *is_block;       /* 1 flag per group: is it one of the MxN mini-rectangle groups (1) or a row/col (0) */
   short *groups;        /* [ng*ns] table of cell indices in each of the groups */
+  int *peer_index;      /* [1 + size of cell_groups] where in peers[] the peers for each
+                           entry of cell_groups start */
+  short *peers;         /* for each cell and group, the other cells in the group that
+                           aren't in one of its earlier groups too */
+  int *isect_index;     /* [ng+1] where in the isect_ tables each group's entries start */
+  short *isect_group;   /* the other groups that each group intersects, in order */
+  unsigned long long *isect_mask;  /* the cells in the intersection, as positions in the group */
+  unsigned long long *isect_other; /* ... and as positions in the other group */
+  int n_overlap;
+  short *overlap_cells; /* [n_overlap] the cells shared between subgrids */
   char **group_names;    /* [ng] array of strings. */
+  int is_plain_9x9;     /* the standard layout, in raster order (bb9.c can solve it) */
+  void *map;            /* the compiled layout file the tables are in, or NULL */
+  size_t map_size;
 };
 /*}}}*/
 struct subgrid {/*{{{*/
@@ -90,11 +105,19 @@ struct subgrid_link {/*{{{*/
   enum corner corner1;
 };
 /*}}}*/
+struct extra_group {/*{{{*/
+  char *name;
+  int *cells;           /* [ns] each as (subgrid * cells per subgrid) + the cell's
+                           index within its subgrid */
+};
+/*}}}*/
 struct super_layout {/*{{{*/
   int n_subgrids;
   struct subgrid *subgrids;
   int n_links;
   struct subgrid_link *links;
+  int n_groups;
+  struct extra_group *groups; /* groups besides those of the subgrids */
 };
 /*}}}*/
 
@@ -109,6 +132,8 @@ struct constraint {/*{{{*/
 /*}}}*/
 
 #define MAX_PARTITION_SIZE 5
+/* A partition bigger than half a group has a smaller one as its complement */
+#define PARTITION_SIZE_LIMIT (MAX_SYMBOLS / 2)
 const extern struct constraint cons_all, cons_none;
 
 /* ============================================================================ */
@@ -125,8 +150,10 @@ const extern struct constraint cons_all, cons_none;
 
 /* ============================================================================ */
 
-#define new(T) (T *) malloc(sizeof(T))
-#define new_array(T, n) (T *) malloc((n) * sizeof(T))
+/* All allocations go through counted_malloc() (in util.c), so that -v can
+ * report how many were made. */
+#define new(T) (T *) counted_malloc(sizeof(T))
+#define new_array(T, n) (T *) counted_malloc((n) * sizeof(T))
 
 #define OPT_VERBOSE (1<<0)
 #define OPT_FIRST_ONLY (1<<1)
@@ -143,18 +170,143 @@ const extern struct constraint cons_all, cons_none;
 #define OPT_SCORE (1<<12)
 #define OPT_SOLVE_MARKED (1<<13)
 #define OPT_SOLVE_MINIMAL (1<<14)
+#define OPT_BATCH (1<<15)
+#define OPT_DLX (1<<16)
+
+#define OPT_SYM_MASK (OPT_SYM_180 | OPT_SYM_90 | OPT_SYM_HORIZ | OPT_SYM_VERT)
+
+/* ============================================================================ */
+
+/* Everything an operation needs to know about the command line, so that the
+ * batch driver can apply it to each grid in turn. */
+struct op_args {/*{{{*/
+  const struct constraint *simplify_cons;
+  const struct constraint *required_cons;
+  int iters_for_min;
+  int grey_cells;
+  int options;
+  int n_threads;
+  long seed;
+};
+/*}}}*/
+
+/* Mutable state belonging to one thread of solving.  The layout is shared
+ * and read-only, so anything that changes while solving lives here or in the
+ * infer() workspace. */
+struct arena {/*{{{*/
+  /* Scratch space handed out stack-fashion: take a mark, allocate, then
+   * release back to the mark. */
+  char *base;
+  size_t size;
+  size_t used;
+};
+/*}}}*/
+struct solver_plan;
+struct context {/*{{{*/
+  unsigned short rng[3];  /* state for nrand48() */
+  int sol_no;             /* number of the last solution shown with -A */
+  FILE *out;              /* where results go (a per-grid buffer when threaded) */
+  struct pool *pool;      /* for speculating in parallel, or NULL */
+  int *abandon;           /* if set non-zero, infer() may give up early */
+  struct arena scratch;   /* for the rules' working buffers */
+  struct solver_plan *plans; /* infer() workspaces kept for reuse; the
+                                layouts they are for must outlive them */
+  struct solver_plan *wide_plans; /* ... and infer_wide()'s */
+  struct solver_plan *narrow_plans; /* ... and infer_narrow()'s */
+};
+/*}}}*/
+
+typedef void (*GRID_OP)(struct context *ctx, struct layout *lay, int *state, const struct op_args *args);
 
 /* ============================================================================ */
 
 /* In util.c */
-extern int count_bits(unsigned int a);
-extern int decode(unsigned int a);
+static inline int count_bits(unsigned int a)/*{{{*/
+{
+#if defined(__GNUC__) && defined(__POPCNT__)
+  return __builtin_popcount(a);
+#else
+  a = a - ((a>>1) & 0x55555555);
+  a = (a & 0x33333333) + ((a>>2) & 0x33333333);
+  a = (a + (a>>4)) & 0x0f0f0f0f;
+  return (a * 0x01010101) >> 24;
+#endif
+}
+/*}}}*/
+static inline int decode(unsigned int a)/*{{{*/
+{
+  /* Index of the lowest set bit, or -1 if none */
+#if defined(__GNUC__)
+  return a ? __builtin_ctz(a) : -1;
+#else
+  int r;
+  if (!a) return -1;
+  for (r=0; !(a & 1); r++) a >>= 1;
+  return r;
+#endif
+}
+/*}}}*/
+static inline int count_bits64(unsigned long long a)/*{{{*/
+{
+#if defined(__GNUC__) && defined(__POPCNT__)
+  return __builtin_popcountll(a);
+#else
+  return count_bits((unsigned int) a) + count_bits((unsigned int) (a >> 32));
+#endif
+}
+/*}}}*/
+static inline int decode64(unsigned long long a)/*{{{*/
+{
+  if ((unsigned int) a) return decode((unsigned int) a);
+  if (a) return 32 + decode((unsigned int) (a >> 32));
+  return -1;
+}
+/*}}}*/
 extern char *tobin(int n, int x);
-extern void show_symbols_in_set(int ns, const char *symbols, int bitmap);
-extern void setup_terminals(struct layout *lay);
+extern void show_symbols_in_set(int ns, const char *symbols, unsigned long long bitmap);
+extern void *counted_malloc(size_t size);
+extern long n_allocations(void);
+extern void init_context(struct context *ctx, long seed);
+extern void seed_context(struct context *ctx, long seed);
+extern void free_context(struct context *ctx);
+extern void arena_reserve(struct arena *a, size_t size);
+extern void *arena_alloc(struct arena *a, size_t size);
+extern long ctx_random(struct context *ctx);
+extern long derive_seed(long seed, int index);
+
+/* In pool.c */
+struct pool;
+struct task_group {/*{{{*/
+  int pending;          /* tasks submitted but not yet finished */
+};
+/*}}}*/
+typedef void (*TASK_FN)(void *arg);
+extern struct pool *pool_create(int n_threads);
+extern void pool_submit(struct pool *p, struct task_group *group, TASK_FN fn, void *arg);
+extern void pool_wait(struct pool *p, struct task_group *group);
+extern int pool_size(const struct pool *p);
+extern void pool_destroy(struct pool *p);
+
+/* In scan.c */
+extern int fewest_candidates(const unsigned int *poss, const signed char *state, int n);
+extern int fewest_candidates_wide(const unsigned long long *poss, const signed char *state, int n);
+extern int fewest_candidates_narrow(const unsigned short *poss, const signed char *state, int n);
+
+/* In bb9.c */
+extern int bb9_solve(struct context *ctx, int *state, int max_solutions);
+
+/* In dlx.c */
+extern int dlx_solve(const struct layout *lay, int *state, int max_solutions, int max_nodes);
 
 /* In infer.c */
-int infer(struct layout *lay, int *state, int *order, int *score, const struct constraint *cons, int options);
+int infer(struct context *ctx, const struct layout *lay, int *state, int *order, char *terminal, int *score, const struct constraint *cons, int options);
+extern void free_plans(struct solver_plan *plans);
+/* ... built with WIDE_SETS, for layouts with more than 32 symbols */
+int infer_wide(struct context *ctx, const struct layout *lay, int *state, int *order, char *terminal, int *score, const struct constraint *cons, int options);
+extern void free_plans_wide(struct solver_plan *plans);
+/* ... and with NARROW_SETS, for layouts with at most 16 */
+int infer_narrow(struct context *ctx, const struct layout *lay, int *state, int *order, char *terminal, int *score, const struct constraint *cons, int options);
+extern void free_plans_narrow(struct solver_plan *plans);
 
 /* In superlayout.c */
 extern void superlayout_5(struct super_layout *superlay);
@@ -172,35 +324,52 @@ extern void free_layout_lite(struct layout *lay);
 
 /* In genlayout.c */
 extern void find_symmetries(struct layout *lay, int options);
+extern void find_cell_groups(struct layout *lay);
+extern void find_peers(struct layout *lay);
+extern void find_intersections(struct layout *lay);
+extern void find_overlap_cells(struct layout *lay);
+extern int plain_9x9_p(const struct layout *lay);
 extern void debug_layout(struct layout *lay);
 extern struct layout *genlayout(const char *name, int options);
-
-/* In reader.c */
+extern struct layout *find_layout(const char *name, int options);
+extern void free_layout_cache(void);
+extern void parse_mn(const char *x, int len, int *M, int *N);
+
+/* In layoutfile.c */
+extern void load_layout_file(const char *path, struct layout *lay, int options);
+extern void write_layout_file(FILE *out, const struct layout *lay);
+extern void free_mapped_layout(struct layout *lay);
+
+/* In reader.c : the layout returned belongs to the layout cache, don't free it. */
+#define READ_NO_HEADER (-1)  /* read_next_grid(): not at a '#layout: ' header */
+#define READ_SHORT (-2)      /* read_next_grid(): the grid is cut short */
 extern void read_grid(struct layout **lay, int **state, int options);
+extern int read_next_grid(struct layout **lay, int **state, int options);
+extern void report_read_error(int status);
+
+/* In batch.c */
+extern void for_each_grid(GRID_OP op, const struct op_args *args);
 
 /* In blank.c */
 extern void blank(struct layout *lay);
 
 /* In display.c */
-void display(FILE *out, struct layout *lay, int *state);
+void display(FILE *out, const struct layout *lay, int *state);
 
 /* In solve.c */
-extern void solve(const struct constraint *simplify_cons, int options);
-extern void solve_any(int options);
+extern void solve(const struct op_args *args);
+extern void solve_any(const struct op_args *args);
 
 /* In reduce.c */
-extern int inner_reduce(struct layout *lay, int *state, const struct constraint *simplify_cons, int options);
-extern void reduce(int iters_for_min,
-    const struct constraint *simplify_cons,
-    const struct constraint *required_cons, 
-    int options);
+extern int inner_reduce(struct context *ctx, struct layout *lay, int *state, const struct constraint *simplify_cons, int options);
+extern void reduce(const struct op_args *args);
 
 /* In mark.c */
-extern void mark_cells(int grey_cells, const struct constraint *simplify_cons, int options);
+extern void mark_cells(const struct op_args *args);
 
 
 /* In grade.c */
-extern void grade(int options);
+extern void grade(const struct op_args *args);
   
 /* In svg.c */
 extern void format_output(int options);
@@ -32,7 +32,7 @@ static int count_marked_cells(struct layout *lay, int *state)/*{{{*/
   return result;
 }
 /*}}}*/
-void solve_minimal(struct layout *lay, int *state, const struct constraint *simplify_cons, int options)/*{{{*/
+void solve_minimal(struct context *ctx, struct layout *lay, int *state, const struct constraint *simplify_cons, int options)/*{{{*/
 {
   int n_solutions;
   int *copy, *copy0;
@@ -45,7 +45,7 @@ void solve_minimal(struct layout *lay, int *state, const struct constraint *simp
   memset(barred, 0, lay->nc);
 
   memcpy(copy, state, lay->nc * sizeof(int));
-  n_solutions = infer(lay, copy, NULL, NULL, simplify_cons, options);
+  n_solutions = infer(ctx, lay, copy, NULL, NULL, NULL, simplify_cons, options);
   if (n_solutions != 1) {
     fprintf(stderr, "Cannot produce minimal solution unless puzzle has a unique solution\n");
     goto get_out;
@@ -57,13 +57,13 @@ void solve_minimal(struct layout *lay, int *state, const struct constraint *simp
     if (state[next_to_bar] == CELL_MARKED) continue;
     memcpy(copy, copy0, lay->nc * sizeof(int));
     copy[next_to_bar] = CELL_BARRED;
-    n_solutions = infer(lay, copy, NULL, NULL, simplify_cons, options);
+    n_solutions = infer(ctx, lay, copy, NULL, NULL, NULL, simplify_cons, options);
     if (n_solutions == 1) {
       barred[next_to_bar] = 1;
       copy0[next_to_bar] = CELL_BARRED;
     }
   }
-  display(stdout, lay, copy0);
+  display(ctx->out, lay, copy0);
   memcpy(state, copy0, lay->nc * sizeof(int));
 
 get_out:
@@ -73,14 +73,13 @@ get_out:
   return;
 }
 /*}}}*/
-void solve(const struct constraint *simplify_cons, int options)/*{{{*/
+static void solve_grid(struct context *ctx, struct layout *lay, int *state, const struct op_args *args)/*{{{*/
 {
-  int *state;
+  const struct constraint *simplify_cons = args->simplify_cons;
+  int options = args->options;
   int n_solutions;
-  struct layout *lay;
   int n_marked;
 
-  read_grid(&lay, &state, options);
   n_marked = count_marked_cells(lay, state);
   if (n_marked > 0) {
     fprintf(stderr, "Found %d marked cell%s to solve for\n",
@@ -88,59 +87,57 @@ void solve(const struct constraint *simplify_cons, int options)/*{{{*/
         n_marked==1 ? "" : "s");
     options |= OPT_SOLVE_MARKED;
   }
-  setup_terminals(lay);
   if (options & OPT_SOLVE_MINIMAL) {
     if (n_marked) {
-      solve_minimal(lay, state, simplify_cons, options);
+      solve_minimal(ctx, lay, state, simplify_cons, options);
     } else {
       fprintf(stderr, "-M specified but puzzle is not marked\n");
       exit(1);
     }
   } else {
-    n_solutions = infer(lay, state, NULL, NULL, simplify_cons, options);
+    n_solutions = infer(ctx, lay, state, NULL, NULL, NULL, simplify_cons, options);
 
     if (n_solutions == 0) {
       fprintf(stderr, "The puzzle had no solutions.\n"
           "Showing how far the solver got before becoming stuck.\n");
-      display(stdout, lay, state);
+      display(ctx->out, lay, state);
     } else if (n_solutions == 1) {
       fprintf(stderr, "The puzzle had precisely 1 solution\n");
-      display(stdout, lay, state);
+      display(ctx->out, lay, state);
     } else {
       if (options & OPT_SHOW_ALL) {
         fprintf(stderr, "The puzzle had %d solutions\n", n_solutions);
       } else {
         fprintf(stderr, "The puzzle had %d solutions (one is shown)\n", n_solutions);
-        display(stdout, lay, state);
+        display(ctx->out, lay, state);
       }
     }
   }
-
-  free(state);
-  free_layout(lay);
-  return;
 }
 /*}}}*/
-void solve_any(int options)/*{{{*/
+void solve(const struct op_args *args)/*{{{*/
+{
+  for_each_grid(solve_grid, args);
+}
+/*}}}*/
+static void solve_any_grid(struct context *ctx, struct layout *lay, int *state, const struct op_args *args)/*{{{*/
 {
-  int *state;
+  int options = args->options;
   int n_solutions;
-  struct layout *lay;
 
-  read_grid(&lay, &state, options);
-  setup_terminals(lay);
-  n_solutions = infer(lay, state, NULL, NULL, &cons_all, OPT_SPECULATE | OPT_FIRST_ONLY | options);
+  n_solutions = infer(ctx, lay, state, NULL, NULL, NULL, &cons_all, OPT_SPECULATE | OPT_FIRST_ONLY | options);
 
   if (n_solutions == 0) {
     fprintf(stderr, "The puzzle had no solutions.\n"
         "Showing how far the solver got before becoming stuck.\n");
   }
 
-  display(stdout, lay, state);
-
-  free(state);
-  free_layout(lay);
-  return;
+  display(ctx->out, lay, state);
+}
+/*}}}*/
+void solve_any(const struct op_args *args)/*{{{*/
+{
+  for_each_grid(solve_any_grid, args);
 }
 /*}}}*/
 
@@ -168,6 +168,11 @@ void free_superlayout(struct super_layout *superlay)/*{{{*/
   }
   free(superlay->subgrids);
   free(superlay->links);
+  for (i=0; i<superlay->n_groups; i++) {
+    free(superlay->groups[i].name);
+    free(superlay->groups[i].cells);
+  }
+  free(superlay->groups);
 }
 /*}}}*/
 void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *superlay, struct layout *lay, int options)/*{{{*/
@@ -180,6 +185,8 @@ void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *
   int tnc;
   int tns;
   int *rmap;
+  int *merged;
+  char *is_overlap;
 
   nsg = superlay->n_subgrids;
   tlay = new_array(struct layout, nsg);
@@ -205,14 +212,9 @@ void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *
       c->pcol += (M-1)*(N+1) * sg->xoff;
       c->rrow += sg->yoff * M*(N-1);
       c->rcol += sg->xoff * N*(M-1);
-
-      for (k=0; k<NDIM; k++) {
-        if (c->group[k] >= 0) {
-          c->group[k] += group_base;
-        } else {
-          break;
-        }
-      }
+    }
+    for (j=0; j<ll->cell_group_index[ll->nc]; j++) {
+      ll->cell_groups[j] += group_base;
     }
     for (j=0; j<ll->ng; j++) {
       for (k=0; k<ll->ns; k++) {
@@ -230,8 +232,11 @@ void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *
   /* Merge into one big table. */
   tns     = tlay[0].ns;
   lay->ns = tns;
+  lay->is_plain_9x9 = 0;
+  lay->map = NULL;
+  lay->map_size = 0;
   tng     = tlay[0].ng;
-  lay->ng = tng * nsg;
+  lay->ng = tng * nsg + superlay->n_groups;
   /* Number of cells excludes the overlaps. */
   tnc = tlay[0].nc;
   lay->nc = tnc * nsg - (superlay->n_links * tns);
@@ -243,6 +248,11 @@ void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *
 
   /* This is oversized to start with - we just don't use the tail end of it later on. */
   lay->cells  = new_array(struct cell, tnc * nsg);
+  is_overlap  = new_array(char, tnc * nsg);
+  merged      = new_array(int, tnc * nsg);
+  for (i=0; i<tnc*nsg; i++) {
+    merged[i] = i;
+  }
 
   lay->n_thicklines = nsg * tlay[0].n_thicklines;
   lay->n_mediumlines = nsg * tlay[0].n_mediumlines;
@@ -264,6 +274,9 @@ void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *
     memcpy(lay->cells + (tnc * i),
            tlay[i].cells,
            sizeof(struct cell) * tnc);
+    memcpy(is_overlap + (tnc * i),
+           tlay[i].is_overlap,
+           sizeof(char) * tnc);
     memcpy(lay->thinlines + (tlay[0].n_thinlines * i),
            tlay[i].thinlines,
            sizeof(struct dline) * tlay[0].n_thinlines);
@@ -302,31 +315,30 @@ void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *
       for (n=0; n<N; n++) {
         int ic0, ic1;
         int q;
-        int ofs;
         struct cell *c0, *c1;
+        const struct layout *t1 = tlay + sgl->index1;
+        int sc1; /* c1's index in its own subgrid */
         ic0 = off0 + m*MN + n;
         ic1 = off1 + m*MN + n;
+        sc1 = ic1 - tnc * sgl->index1;
         c0 = lay->cells + ic0;
         c1 = lay->cells + ic1;
-        /* Copy 2ary cell's groups into 1ary cell's table.  First, find the end
-         * of the existing group list on the 1ary cell. */
-        for (ofs=0; ofs<NDIM; ofs++) {
-          if (c0->group[ofs] < 0) break;
-        }
-        for (q=0; q<NDIM; q++) {
-          if (c1->group[q] < 0) break;
-          c0->group[ofs+q] = c1->group[q];
+        if ((c0->index < 0) || (c1->index < 0)) {
+          fprintf(stderr, "Cell %s is linked more than once\n",
+              (c0->index < 0) ? c0->name : c1->name);
+          exit(1);
         }
         /* Merge cell names */
         sprintf(buffer, "%s/%s", c0->name, c1->name);
         free(c0->name);
         c0->name = strdup(buffer);
-        c0->is_overlap = 1;
-        /* For each group c1 is in, change the index to point to c0 */
-        for (q=0; q<NDIM; q++) {
+        is_overlap[ic0] = 1;
+        /* For each group c1 is in, change the index to point to c0.  (c0's
+         * list of groups is worked out from these when the merging is
+         * done.) */
+        for (q=t1->cell_group_index[sc1]; q<t1->cell_group_index[sc1+1]; q++) {
           int r;
-          int grp = c1->group[q];
-          if (grp < 0) break;
+          int grp = t1->cell_groups[q];
           for (r=0; r<tns; r++) {
             if (lay->groups[tns*grp + r] == ic1) {
               lay->groups[tns*grp + r] = ic0;
@@ -336,6 +348,7 @@ void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *
         }
         /* Mark c1 as being defunct */
         c1->index = -1;
+        merged[ic1] = ic0;
       }
     }
   }
@@ -358,8 +371,23 @@ void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *
       /* Don't need to repair index fields of cells as they're not used after this. */
     }
   }
+  /* Cells of different subgrids in the same place have to be linked. */
+  for (i=1; i<lay->nc; i++) {
+    struct cell *c0 = lay->cells + i - 1, *c1 = lay->cells + i;
+    if ((c0->prow == c1->prow) && (c0->pcol == c1->pcol)) {
+      fprintf(stderr, "Cells %s and %s overlap without a link\n", c0->name, c1->name);
+      exit(1);
+    }
+  }
+
+  /* The overlap flags follow the cells to their sorted places. */
+  lay->is_overlap = new_array(char, lay->nc);
+  for (i=0; i<lay->nc; i++) {
+    lay->is_overlap[i] = is_overlap[lay->cells[i].index];
+  }
+  free(is_overlap);
   /* Repair indexing (and in all groups) */
-  for (i=0; i<lay->ns*lay->ng; i++) {
+  for (i=0; i<tns*tng*nsg; i++) {
     int new_idx;
     new_idx = rmap[lay->groups[i]];
     if (new_idx >= 0) {
@@ -369,7 +397,27 @@ void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *
     }
   }
 
+  /* Add the extra groups, now that the cells are where they end up. */
+  for (i=0; i<superlay->n_groups; i++) {
+    const struct extra_group *eg = superlay->groups + i;
+    int gi = tng * nsg + i;
+    int j, k;
+    lay->group_names[gi] = strdup(eg->name);
+    lay->is_block[gi] = 0;
+    for (j=0; j<tns; j++) {
+      int ic = rmap[merged[eg->cells[j]]];
+      for (k=0; k<j; k++) {
+        if (lay->groups[gi*tns + k] == ic) {
+          fprintf(stderr, "Cell %s is in group %s twice\n", lay->cells[ic].name, eg->name);
+          exit(1);
+        }
+      }
+      lay->groups[gi*tns + j] = ic;
+    }
+  }
+  free(merged);
   free(rmap);
+
   /* Determine prows and pcols */
   lay->prows = 0;
   lay->pcols = 0;
@@ -381,6 +429,10 @@ void layout_MxN_superlay(int M, int N, int x_layout, const struct super_layout *
   ++lay->pcols;
 
   find_symmetries(lay, options);
+  find_cell_groups(lay);
+  find_peers(lay);
+  find_intersections(lay);
+  find_overlap_cells(lay);
 
   /* Purge buried cells */
   for (i=lay->nc; i < nsg*tlay->nc; i++) {
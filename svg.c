@@ -113,6 +113,5 @@ void format_output(int options)/*{{{*/
   printf("</svg>\n");
 
   free(state);
-  free_layout(lay);
 }
 /*}}}*/
@@ -26,7 +26,6 @@ void tidy(int options)
   read_grid(&lay, &state, options);
   display(stdout, lay, state);
   free(state);
-  free_layout(lay);
   return;
 }
 
@@ -19,31 +19,6 @@
 
 #include "sku.h"
 
-int count_bits(unsigned int a)/*{{{*/
-{
-  a = (a & 0x55555555) + ((a>>1) & 0x55555555);
-  a = (a & 0x33333333) + ((a>>2) & 0x33333333);
-  a = (a & 0x0f0f0f0f) + ((a>>4) & 0x0f0f0f0f);
-  a = (a & 0x00ff00ff) + ((a>>8) & 0x00ff00ff);
-  a = (a & 0x0000ffff) + ((a>>16) & 0x0000ffff);
-  return a;
-}
-/*}}}*/
-int decode(unsigned int a)/*{{{*/
-{
-  /* This needs optimising?? */
-
-  int r, m;
-  m = 1;
-  r = 0;
-  if (!a) return -1;
-  while (1) {
-    if (a & m) return r;
-    r++;
-    m <<= 1;
-  }
-}
-/*}}}*/
 char *tobin(int n, int x)/*{{{*/
 {
   int i;
@@ -57,12 +32,13 @@ char *tobin(int n, int x)/*{{{*/
   return buffer;
 }
 /*}}}*/
-void show_symbols_in_set(int ns, const char *symbols, int bitmap)/*{{{*/
+void show_symbols_in_set(int ns, const char *symbols, unsigned long long bitmap)/*{{{*/
 {
-  int i, mask;
+  int i;
+  unsigned long long mask;
   int first = 1;
   for (i=0; i<ns; i++) {
-    mask = 1<<i;
+    mask = 1ULL<<i;
     if (bitmap & mask) {
       if (!first) fprintf(stderr, ",");
       first = 0;
@@ -71,12 +47,93 @@ void show_symbols_in_set(int ns, const char *symbols, int bitmap)/*{{{*/
   }
 }
 /*}}}*/
-void setup_terminals(struct layout *lay)/*{{{*/
+static long allocation_count = 0;
+
+void *counted_malloc(size_t size)/*{{{*/
 {
-  int i;
-  for (i=0; i<lay->nc; i++) {
-    lay->cells[i].is_terminal = 1;
+  __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+  return malloc(size);
+}
+/*}}}*/
+long n_allocations(void)/*{{{*/
+{
+  return __atomic_load_n(&allocation_count, __ATOMIC_RELAXED);
+}
+/*}}}*/
+void seed_context(struct context *ctx, long seed)/*{{{*/
+{
+  /* Same initial state as srand48(seed), so a given seed produces the same
+   * sequence as the old global generator did. */
+  ctx->rng[0] = 0x330e;
+  ctx->rng[1] = (unsigned short) (seed & 0xffff);
+  ctx->rng[2] = (unsigned short) ((seed >> 16) & 0xffff);
+  ctx->sol_no = 0;
+}
+/*}}}*/
+void init_context(struct context *ctx, long seed)/*{{{*/
+{
+  seed_context(ctx, seed);
+  ctx->out = stdout;
+  ctx->pool = NULL;
+  ctx->abandon = NULL;
+  ctx->scratch.base = NULL;
+  ctx->scratch.size = 0;
+  ctx->scratch.used = 0;
+  ctx->plans = NULL;
+  ctx->wide_plans = NULL;
+  ctx->narrow_plans = NULL;
+}
+/*}}}*/
+void free_context(struct context *ctx)/*{{{*/
+{
+  free(ctx->scratch.base);
+  ctx->scratch.base = NULL;
+  ctx->scratch.size = 0;
+  free_plans(ctx->plans);
+  ctx->plans = NULL;
+  free_plans_wide(ctx->wide_plans);
+  ctx->wide_plans = NULL;
+  free_plans_narrow(ctx->narrow_plans);
+  ctx->narrow_plans = NULL;
+}
+/*}}}*/
+void arena_reserve(struct arena *a, size_t size)/*{{{*/
+{
+  /* Make sure there is room for 'size' bytes.  Only to be called when nothing
+   * is allocated from the arena. */
+  if (a->size < size) {
+    free(a->base);
+    a->base = new_array(char, size);
+    a->size = size;
+  }
+  a->used = 0;
+}
+/*}}}*/
+void *arena_alloc(struct arena *a, size_t size)/*{{{*/
+{
+  void *result;
+  size = (size + 7) & ~(size_t) 7;
+  if (a->used + size > a->size) {
+    fprintf(stderr, "Scratch arena too small (%lu + %lu > %lu)\n",
+        (unsigned long) a->used, (unsigned long) size, (unsigned long) a->size);
+    exit(2);
   }
+  result = a->base + a->used;
+  a->used += size;
+  return result;
+}
+/*}}}*/
+long derive_seed(long seed, int index)/*{{{*/
+{
+  /* Seed for the index'th of a set of independent jobs (grids in a batch,
+   * iterations of reduce -m), so that the results don't depend on how the
+   * jobs were shared out between threads. */
+  return seed + (long) index * 0x9e3779b9L;
+}
+/*}}}*/
+long ctx_random(struct context *ctx)/*{{{*/
+{
+  return nrand48(ctx->rng);
 }
 /*}}}*/
 